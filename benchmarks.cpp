@@ -0,0 +1,126 @@
+// benchmarks.cpp : Throughput benchmarks for sanity.h
+//
+
+#include "stdafx.h"
+
+#include "sanity.h"
+
+// Runs body(thread) on nthreads threads at once and returns the seconds taken.
+template <typename F>
+double timeThreads(unsigned nthreads, const F& body) {
+   std::vector<std::thread> threads;
+   auto start = std::chrono::steady_clock::now();
+   for (unsigned i = 0; i < nthreads; ++i) {
+      threads.push_back(std::thread([&body, i]() { body(i); }));
+   }
+   for (auto& thread : threads) {
+      thread.join();
+   }
+   return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void report(const std::string& name, unsigned nthreads, size_t ops, double seconds) {
+   std::cout << name << "\t" << nthreads << " threads\t" << (long) (ops / seconds) << " ops/s" << std::endl;
+}
+
+// Transfers between accounts with dosync, against one mutex guarding them all.
+void benchmarkRefs() {
+   const size_t accounts = 16;
+   const size_t transfers = 400000;
+   for (unsigned nthreads = 1; nthreads <= 16; nthreads *= 2) {
+      std::vector<std::unique_ptr<ref<long>>> refs;
+      for (size_t i = 0; i < accounts; ++i) {
+         refs.emplace_back(new ref<long>(1000));
+      }
+      double seconds = timeThreads(nthreads, [&](unsigned thread) {
+         std::mt19937 random(thread);
+         for (size_t i = 0; i < transfers / nthreads; ++i) {
+            ref<long>& from = *refs[random() % accounts];
+            ref<long>& to = *refs[random() % accounts];
+            dosync([&](transaction& tx) {
+               tx.alter(from, add<long, long>, -1L);
+               tx.alter(to, add<long, long>, 1L);
+            });
+         }
+      });
+      report("dosync", nthreads, transfers, seconds);
+
+      std::mutex lock;
+      std::vector<long> balances(accounts, 1000);
+      seconds = timeThreads(nthreads, [&](unsigned thread) {
+         std::mt19937 random(thread);
+         for (size_t i = 0; i < transfers / nthreads; ++i) {
+            size_t from = random() % accounts;
+            size_t to = random() % accounts;
+            std::lock_guard<std::mutex> guard(lock);
+            --balances[from];
+            ++balances[to];
+         }
+      });
+      report("mutex", nthreads, transfers, seconds);
+   }
+}
+
+// 64 threads swapping new keys into one atom holding a pmap.
+void benchmarkAtom() {
+   const unsigned swappers = 64;
+   const long swapsEach = 5000;
+   atom<pmap<long, long>> shared;
+   double seconds = timeThreads(swappers, [&](unsigned thread) {
+      for (long i = 0; i < swapsEach; ++i) {
+         shared.swap([](const pmap<long, long>& m, long key) { return assoc(m, key, key); }, thread * swapsEach + i);
+      }
+   });
+   if (shared.deref()->size() != swappers * swapsEach) {
+      std::cout << "atom lost updates" << std::endl;
+   }
+   report("atom swap", swappers, swappers * swapsEach, seconds);
+}
+
+// Returns the seconds taken by body(), best of five runs.
+template <typename F>
+double timeBest(const F& body) {
+   double best = 1e9;
+   for (int run = 0; run < 5; ++run) {
+      auto start = std::chrono::steady_clock::now();
+      body();
+      best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+   }
+   return best;
+}
+
+long twice(long x) {
+   return 2 * x;
+}
+
+// Composed predicates and functions against hand-written lambdas and
+// std::function, over filter and map of 10M longs.
+void benchmarkComposition() {
+   std::vector<long> numbers = range(10000000L);
+   long sink = 0;
+   double seconds = timeBest([&]() {
+      sink += map(filter(numbers, [](long x) { return !(x % 3 == 0); }), [](long x) { return 2 * (x + 1); }).size();
+   });
+   report("lambdas", 1, numbers.size(), seconds);
+   seconds = timeBest([&]() {
+      sink += map(filter(numbers, complement([](long x) { return x % 3 == 0; })), comp(twice, partial(add<long, long>, 1L))).size();
+   });
+   report("comp/partial/complement", 1, numbers.size(), seconds);
+   std::function<bool(long)> divisible = [](long x) { return x % 3 == 0; };
+   std::function<long(long)> plusOne = [](long x) { return x + 1; };
+   std::function<long(long)> doubled = twice;
+   seconds = timeBest([&]() {
+      sink += map(filter(numbers, [&](long x) { return !divisible(x); }), [&](long x) { return doubled(plusOne(x)); }).size();
+   });
+   report("std::function", 1, numbers.size(), seconds);
+   if (sink == 0) {
+      std::cout << sink << std::endl;
+   }
+}
+
+int _tmain(int argc, _TCHAR* argv[]) {
+   benchmarkComposition();
+   benchmarkAtom();
+   benchmarkRefs();
+   return 0;
+}
@@ -14,16 +14,216 @@
 // MIT License
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <exception>
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <iterator>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 #include <random>
 #include <regex>
+#include <set>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+
+// ## Function composition.
+//
+// These return small function objects rather than std::function, so the
+// compiler can inline the composed calls completely.
+
+namespace sanity_detail {
+
+template <size_t... I>
+struct indexSequence {};
+
+template <size_t N, size_t... I>
+struct makeIndexSequence : makeIndexSequence<N - 1, N - 1, I...> {};
+
+template <size_t... I>
+struct makeIndexSequence<0, I...> {
+   typedef indexSequence<I...> type;
+};
+
+template <typename F>
+class complementFn {
+public:
+   explicit complementFn(const F& func) : func(func) {}
+   template <typename... A>
+   auto operator()(A&&... args) const -> decltype(!std::declval<const F&>()(std::forward<A>(args)...)) {
+      return !func(std::forward<A>(args)...);
+   }
+private:
+   F func;
+};
+
+template <typename F, typename G>
+class compFn {
+public:
+   compFn(const F& f, const G& g) : f(f), g(g) {}
+   template <typename... A>
+   auto operator()(A&&... args) const -> decltype(std::declval<const F&>()(std::declval<const G&>()(std::forward<A>(args)...))) {
+      return f(g(std::forward<A>(args)...));
+   }
+private:
+   F f;
+   G g;
+};
+
+// Nests compFn objects right to left: comp(f, g, h) is compFn<f, compFn<g, h>>.
+template <typename F, typename... FS>
+struct compBuilder {
+   typedef compFn<F, typename compBuilder<FS...>::type> type;
+   static type build(const F& f, const FS&... fs) {
+      return type(f, compBuilder<FS...>::build(fs...));
+   }
+};
+
+template <typename F>
+struct compBuilder<F> {
+   typedef F type;
+   static F build(const F& f) {
+      return f;
+   }
+};
+
+template <typename F, typename... BOUND>
+class partialFn {
+public:
+   partialFn(const F& func, const BOUND&... bound) : func(func), bound(bound...) {}
+   template <typename... A>
+   auto operator()(A&&... args) const -> decltype(std::declval<const F&>()(std::declval<const BOUND&>()..., std::forward<A>(args)...)) {
+      return call(typename makeIndexSequence<sizeof...(BOUND)>::type(), std::forward<A>(args)...);
+   }
+private:
+   template <size_t... I, typename... A>
+   auto call(indexSequence<I...>, A&&... args) const
+         -> decltype(std::declval<const F&>()(std::declval<const BOUND&>()..., std::forward<A>(args)...)) {
+      return func(std::get<I>(bound)..., std::forward<A>(args)...);
+   }
+   F func;
+   std::tuple<BOUND...> bound;
+};
+
+template <typename... FS>
+class juxtFn {
+public:
+   explicit juxtFn(const FS&... funcs) : funcs(funcs...) {}
+   template <typename... A>
+   auto operator()(const A&... args) const -> std::tuple<decltype(std::declval<const FS&>()(args...))...> {
+      return call(typename makeIndexSequence<sizeof...(FS)>::type(), args...);
+   }
+private:
+   template <size_t... I, typename... A>
+   auto call(indexSequence<I...>, const A&... args) const -> std::tuple<decltype(std::declval<const FS&>()(args...))...> {
+      return std::tuple<decltype(std::declval<const FS&>()(args...))...>(std::get<I>(funcs)(args...)...);
+   }
+   std::tuple<FS...> funcs;
+};
+
+template <typename F, typename D>
+class fnilFn {
+public:
+   fnilFn(const F& func, const D& fallback) : func(func), fallback(fallback) {}
+   template <typename P, typename... A>
+   auto operator()(const P& maybe, A&&... args) const -> decltype(std::declval<const F&>()(std::declval<const D&>(), std::forward<A>(args)...)) {
+      return maybe ? func(*maybe, std::forward<A>(args)...) : func(fallback, std::forward<A>(args)...);
+   }
+private:
+   F func;
+   D fallback;
+};
+
+template <typename T>
+class constantlyFn {
+public:
+   explicit constantlyFn(const T& val) : val(val) {}
+   template <typename... A>
+   T operator()(const A&...) const {
+      return val;
+   }
+private:
+   T val;
+};
+
+} // namespace sanity_detail
+
+// __complement(func)__.
+// Returns a function returning !func(args...).
+//
+// `filter([1,2,3,4], complement(isEven)) => [1,3]`
+template <typename F>
+sanity_detail::complementFn<typename std::decay<F>::type> complement(const F& func) {
+   return sanity_detail::complementFn<typename std::decay<F>::type>(func);
+}
+
+// __comp(f, g, ...)__.
+// Returns the composition of the functions: comp(f, g)(x) == f(g(x)).
+//
+// `comp(inc, times2)(5) => 11`
+template <typename... FS>
+typename sanity_detail::compBuilder<typename std::decay<FS>::type...>::type comp(const FS&... funcs) {
+   return sanity_detail::compBuilder<typename std::decay<FS>::type...>::build(funcs...);
+}
+
+// __partial(func, args...)__.
+// Returns func with its leading arguments bound to args.
+//
+// `map([1,2,3], partial(add, 10)) => [11,12,13]`
+template <typename F, typename... BOUND>
+sanity_detail::partialFn<typename std::decay<F>::type, BOUND...> partial(const F& func, const BOUND&... bound) {
+   return sanity_detail::partialFn<typename std::decay<F>::type, BOUND...>(func, bound...);
+}
+
+// __juxt(f, g, ...)__.
+// Returns a function returning the tuple of each function's result.
+//
+// `juxt(inc, dec)(5) => (6, 4)`
+template <typename... FS>
+sanity_detail::juxtFn<typename std::decay<FS>::type...> juxt(const FS&... funcs) {
+   return sanity_detail::juxtFn<typename std::decay<FS>::type...>(funcs...);
+}
+
+// __fnil(func, fallback)__.
+// Returns a function taking a pointer-like first argument (such as the
+// result of pmap::valAt) and calling func with fallback when it is null.
+//
+// `fnil(inc, 0)(map.valAt(key))`
+template <typename F, typename D>
+sanity_detail::fnilFn<typename std::decay<F>::type, D> fnil(const F& func, const D& fallback) {
+   return sanity_detail::fnilFn<typename std::decay<F>::type, D>(func, fallback);
+}
+
+// __constantly(val)__.
+// Returns a function that ignores its arguments and returns val.
+template <typename T>
+sanity_detail::constantlyFn<T> constantly(const T& val) {
+   return sanity_detail::constantlyFn<T>(val);
+}
 
 // __range(start, end, step)__.
 // Returns an arithmetic progression of numbers.
@@ -71,6 +271,15 @@ C rest(const C& coll) {
    return C(coll.begin() + 1, coll.end());
 }
 
+// __butlast(coll)__.
+// Takes all but the last element in a collection.
+//
+// `butlast([1,2,3,4]) => [1,2,3]`
+template <typename C>
+C butlast(const C& coll) {
+   return coll.empty() ? coll : C(coll.begin(), coll.end() - 1);
+}
+
 // __last(coll)__.
 // Returns last element in a collection.
 //
@@ -201,7 +410,7 @@ C filter(const C& coll, const F& predicate) {
 // with only those values where predicate(value) == FALSE.
 template <typename C, typename F>
 C remove(const C& coll, const F& predicate) {
-   return filter(coll, [&](typename C::value_type elem) { return !predicate(elem); } );
+   return filter(coll, complement(predicate));
 }
 
 // __every(coll, predicate)__.
@@ -220,8 +429,8 @@ bool every(const C& coll, const F& predicate) {
 // __any(coll, predicate)__.
 // Returns true if for any value, predicate(value) == TRUE.
 template <typename C, typename F>
-bool any(const C& input, const F& predicate) {
-   return !every(input, [&](decltype(first(coll)) elem) {return !predicate(elem); } );
+bool any(const C& coll, const F& predicate) {
+   return !every(coll, complement(predicate));
 }
 
 // __contains(coll, value)__.
@@ -264,13 +473,34 @@ typename C::value_type nth(const C& coll, long index, typename C::value_type not
    return coll.size() >= index ? notFound : coll[index];
 }
 
+namespace sanity_detail {
+
+// Reserves room for n elements in coll if it has a reserve member, such
+// as a vector or string; does nothing for a deque or list.
+template <typename C>
+auto reserveIfPossible(C& coll, size_t n, int) -> decltype(coll.reserve(n), void()) {
+   coll.reserve(n);
+}
+
+template <typename C>
+void reserveIfPossible(C&, size_t, long) {}
+
+template <typename C>
+void reserveIfPossible(C& coll, size_t n) {
+   reserveIfPossible(coll, n, 0);
+}
+
+} // namespace sanity_detail
+
 // __cons(coll, item)__.
 // Returns a new coll with item as the first element and rest as input coll.
+// Copies coll once; use a pdeque for O(1) cons.
 template <typename C>
 C cons(const C& coll, typename C::value_type item) {
    C result;
-   result.assign(coll.begin(), coll.end());
-   result.insert(result.begin(), item);
+   sanity_detail::reserveIfPossible(result, coll.size() + 1);
+   result.push_back(item);
+   result.insert(result.end(), coll.begin(), coll.end());
    return result;
 }
 
@@ -288,11 +518,11 @@ C conj(const C& coll, typename C::value_type item) {
 // Returns the first n items of coll.
 template <typename C>
 C take(const C& coll, long n) {
-   if (coll.size() > n) {
+   if (n >= (long) coll.size()) {
       return coll;
    } else {
       C result;
-      result.assign(coll.begin(), coll.begin() + n);
+      result.assign(coll.begin(), coll.begin() + std::max(0L, n));
       return result;
    }
 }
@@ -316,12 +546,12 @@ C takeWhile(const C& coll, const F& predicate) {
 // Returns coll with the first n items removed.
 template <typename C>
 C drop(const C& coll, long n) {
-   if (coll.size() > n) {
+   if (n >= (long) coll.size()) {
       // Drop all elements, so return an empty coll.
       return C();
    } else {
       C result;
-      result.assign(coll.begin() + n, coll.end());
+      result.assign(coll.begin() + std::max(0L, n), coll.end());
       return result;
    }
 }
@@ -384,10 +614,9 @@ C iterate(long n, const F& func, const A& val) {
 template <typename C1, typename C2>
 C1 concat(const C1& coll1, const C2& coll2) {
    C1 result;
-   result.assign(vec1.begin(), vec1.end());
-   for (C2 elem : vec2) {
-      result.push_back(elem);
-   }
+   sanity_detail::reserveIfPossible(result, coll1.size() + coll2.size());
+   result.assign(coll1.begin(), coll1.end());
+   result.insert(result.end(), coll2.begin(), coll2.end());
    return result;
 }
 
@@ -396,12 +625,11 @@ C1 concat(const C1& coll1, const C2& coll2) {
 template <typename C1, typename C2>
 C1 interleave(const C1& coll1, const C2& coll2) {
    C1 result;
-   int n1 = coll1.size();
-   int n2 = coll2.size();
-   int n = min(n1, n2);
-   for (int i = 0; i < n; ++i) {
+   size_t n = std::min(coll1.size(), coll2.size());
+   sanity_detail::reserveIfPossible(result, 2 * n);
+   for (size_t i = 0; i < n; ++i) {
       result.push_back(coll1[i]);
-      result.push_back(coll22[i]);
+      result.push_back(coll2[i]);
    }
    return result;
 }
@@ -420,26 +648,158 @@ C interpose(const C& coll, const A& sep) {
 
 }
 
+// __groupBy(coll, func)__.
+// Returns a map from each func(item) to the items giving that result, in order.
+//
+// `groupBy([1,2,3,4], isEven) => {false: [1,3], true: [2,4]}`
+template <typename C, typename F>
+auto groupBy(const C& coll, const F& func) -> std::map<decltype(func(first(coll))), std::vector<typename C::value_type>> {
+   std::map<decltype(func(first(coll))), std::vector<typename C::value_type>> result;
+   for (const auto& element : coll) {
+      result[func(element)].push_back(element);
+   }
+   return result;
+}
+
+// __frequencies(coll)__.
+// Returns a map from each distinct item to the number of times it occurs.
+//
+// `frequencies([1,2,1]) => {1: 2, 2: 1}`
+template <typename C>
+std::map<typename C::value_type, long> frequencies(const C& coll) {
+   std::map<typename C::value_type, long> result;
+   for (const auto& element : coll) {
+      ++result[element];
+   }
+   return result;
+}
+
+// ## Keywords.
+
+namespace sanity_detail {
+
+struct keywordEntry {
+   std::string name;
+   size_t hash;
+   size_t id;
+};
+
+// The global intern table behind keyword. Entries live for the whole
+// process, so a keyword can be a bare pointer to its entry.
+class keywordTable {
+public:
+   static const keywordEntry* intern(const std::string& name) {
+      static keywordTable table;
+      size_t hash = std::hash<std::string>()(name);
+      shard& s = table.shards[hash % shardCount];
+      std::lock_guard<std::mutex> guard(s.lock);
+      std::unique_ptr<keywordEntry>& entry = s.entries[name];
+      if (!entry) {
+         entry.reset(new keywordEntry());
+         entry->name = name;
+         entry->hash = hash;
+         entry->id = table.nextId++;
+      }
+      return entry.get();
+   }
+
+private:
+   static const size_t shardCount = 64;
+
+   keywordTable() : nextId(0) {}
+
+   struct shard {
+      std::mutex lock;
+      std::unordered_map<std::string, std::unique_ptr<keywordEntry>> entries;
+   };
+
+   shard shards[shardCount];
+   std::atomic<size_t> nextId;
+};
+
+} // namespace sanity_detail
+
+// __keyword__.
+// An interned name, the size of a pointer. Creating a keyword looks its
+// name up once in a global table; after that, equality is a pointer
+// comparison and the hash is precomputed, so keywords make cheap keys for
+// std::map, unordered_map and pmap. Keywords order alphabetically by
+// name, so sorted containers iterate the same way in every run.
+//
+// `std::map<keyword, int> m = {{"x", 1}}; get(m, "x", 0) => 1`
+class keyword {
+public:
+   keyword() : entry(emptyEntry()) {}
+   keyword(const std::string& name) : entry(sanity_detail::keywordTable::intern(name)) {}
+   keyword(const char* name) : entry(sanity_detail::keywordTable::intern(name)) {}
+
+   const std::string& name() const { return entry->name; }
+   size_t hash() const { return entry->hash; }
+   size_t id() const { return entry->id; }
+
+   bool operator==(const keyword& other) const { return entry == other.entry; }
+   bool operator!=(const keyword& other) const { return entry != other.entry; }
+   bool operator<(const keyword& other) const { return entry != other.entry && entry->name < other.entry->name; }
+   bool operator>(const keyword& other) const { return other < *this; }
+   bool operator<=(const keyword& other) const { return !(other < *this); }
+   bool operator>=(const keyword& other) const { return !(*this < other); }
+
+private:
+   static const sanity_detail::keywordEntry* emptyEntry() {
+      static const sanity_detail::keywordEntry* empty = sanity_detail::keywordTable::intern(std::string());
+      return empty;
+   }
+
+   const sanity_detail::keywordEntry* entry;
+};
+
+inline std::ostream& operator<<(std::ostream& out, const keyword& k) {
+   return out << ':' << k.name();
+}
+
+namespace std {
+
+template <>
+struct hash<keyword> {
+   size_t operator()(const keyword& k) const { return k.hash(); }
+};
+
+} // namespace std
+
 // ## Functions for manipulating Maps.
 
+namespace sanity_detail {
+
+// Keeps a parameter out of template argument deduction, so keys and vals
+// convert to the map's types, e.g. a string literal to a keyword.
+template <typename T>
+struct nonDeduced {
+   typedef T type;
+};
+
+} // namespace sanity_detail
+
 // __hasKey(map, key)__.
 // Returns true if map contains a key.
 template <typename K, typename V>
-bool hasKey(const std::map<K, V>& map, const K& key) {
-   return kmap.find(key) != kmap.end();
+bool hasKey(const std::map<K, V>& map, const typename sanity_detail::nonDeduced<K>::type& key) {
+   return map.find(key) != map.end();
 }
 
 // __get(map, key, notFound)__.
 // Gets the val in map corresponding to key.
 template <typename K, typename V>
-V get(const std::map<K, V>& map, const K& key, V value, V notFound) {
-   return hasKey(map, key) ? map[key] : notFound;
+V get(const std::map<K, V>& map, const typename sanity_detail::nonDeduced<K>::type& key,
+      const typename sanity_detail::nonDeduced<V>::type& notFound) {
+   auto iter = map.find(key);
+   return iter != map.end() ? iter->second : notFound;
 }
 
 // __assoc(map, key, val)__.
 // Adds a key, val pair to a map.
 template <typename K, typename V>
-std::map<K, V> assoc(const std::map<K, V>& map, const K& key, const V& val) {
+std::map<K, V> assoc(const std::map<K, V>& map, const typename sanity_detail::nonDeduced<K>::type& key,
+                     const typename sanity_detail::nonDeduced<V>::type& val) {
    std::map<K, V> result(map);
    result[key] = val;
    return result;
@@ -448,10 +808,10 @@ std::map<K, V> assoc(const std::map<K, V>& map, const K& key, const V& val) {
 // __dissoc(map, key)__.
 // Removes a key, val pair from a map.
 template <typename K, typename V>
-std::map<K, V> dissoc(const std::map<K, V>& map, const K& key) {
+std::map<K, V> dissoc(const std::map<K, V>& map, const typename sanity_detail::nonDeduced<K>::type& key) {
    if (hasKey(map, key)) {
       std::map<K, V> result(map);
-      delete result[key];
+      result.erase(key);
       return result;
    } else {
       return map;
@@ -491,17 +851,203 @@ std::vector<std::pair<K, V>> pairs(const std::map<K, V>& m) {
    return result;
 }
 
+namespace sanity_detail {
+
+// Runs func(begin, end) over [0, n) split into one contiguous chunk per thread.
+// The first exception thrown by any chunk is rethrown once all have finished.
+template <typename F>
+void parallelChunks(size_t n, unsigned nthreads, const F& func) {
+   if (nthreads < 2 || n < 2) {
+      func((size_t) 0, n);
+      return;
+   }
+   size_t chunk = (n + nthreads - 1) / nthreads;
+   size_t count = (n + chunk - 1) / chunk;
+   std::vector<std::exception_ptr> errors(count);
+   std::vector<std::thread> workers;
+   for (size_t i = 1; i < count; ++i) {
+      size_t begin = i * chunk;
+      size_t end = std::min(n, begin + chunk);
+      std::exception_ptr& error = errors[i];
+      workers.push_back(std::thread([&func, &error, begin, end]() {
+         try {
+            func(begin, end);
+         } catch (...) {
+            error = std::current_exception();
+         }
+      }));
+   }
+   try {
+      func((size_t) 0, std::min(n, chunk));
+   } catch (...) {
+      errors[0] = std::current_exception();
+   }
+   for (auto& worker : workers) {
+      worker.join();
+   }
+   for (auto& error : errors) {
+      if (error) {
+         std::rethrow_exception(error);
+      }
+   }
+}
+
+struct noCheckpoint {
+   void operator()() const {}
+};
+
+// Stable sort of vec: chunks are sorted on separate threads, then merged pairwise.
+// checkpoint() is called before sorting each chunk and before each merge.
+template <typename T, typename F, typename CHECK>
+void parallelStableSort(std::vector<T>& vec, const F& comparisonFunction, unsigned nthreads, const CHECK& checkpoint) {
+   size_t n = vec.size();
+   if (nthreads < 2 || n < 2) {
+      checkpoint();
+      std::stable_sort(vec.begin(), vec.end(), comparisonFunction);
+      return;
+   }
+   size_t chunk = (n + nthreads - 1) / nthreads;
+   parallelChunks(n, nthreads, [&](size_t begin, size_t end) {
+      checkpoint();
+      std::stable_sort(vec.begin() + begin, vec.begin() + end, comparisonFunction);
+   });
+   for (; chunk < n; chunk *= 2) {
+      parallelChunks((n + 2 * chunk - 1) / (2 * chunk), nthreads, [&](size_t from, size_t to) {
+         for (size_t i = from; i < to; ++i) {
+            checkpoint();
+            size_t begin = i * 2 * chunk;
+            size_t middle = std::min(n, begin + chunk);
+            size_t end = std::min(n, begin + 2 * chunk);
+            std::inplace_merge(vec.begin() + begin, vec.begin() + middle, vec.begin() + end, comparisonFunction);
+         }
+      });
+   }
+}
+
+template <typename T, typename F>
+void parallelStableSort(std::vector<T>& vec, const F& comparisonFunction, unsigned nthreads) {
+   parallelStableSort(vec, comparisonFunction, nthreads, noCheckpoint());
+}
+
+// True if every key is strictly less than the key after it.
+template <typename CK>
+bool isStrictlySorted(const CK& keys) {
+   auto iter = keys.begin();
+   if (iter == keys.end()) {
+      return true;
+   }
+   for (auto prev = iter++; iter != keys.end(); prev = iter++) {
+      if (!(*prev < *iter)) {
+         return false;
+      }
+   }
+   return true;
+}
+
+// Fills a map from keys and vals. Later duplicates overwrite earlier ones.
+// Strictly sorted keys are appended at the end of the tree in amortized O(1) each.
+template <typename K, typename V, typename CK, typename CV>
+void zipInto(std::map<K, V>& result, const CK& keys, const CV& vals) {
+   auto val = vals.begin();
+   if (isStrictlySorted(keys)) {
+      for (const auto& key : keys) {
+         result.insert(result.end(), std::pair<const K, V>(key, *val++));
+      }
+   } else {
+      for (const auto& key : keys) {
+         result[key] = *val++;
+      }
+   }
+}
+
+template <typename K, typename V, typename CK, typename CV>
+void zipInto(std::unordered_map<K, V>& result, const CK& keys, const CV& vals) {
+   result.reserve(keys.size());
+   auto val = vals.begin();
+   for (const auto& key : keys) {
+      result[key] = *val++;
+   }
+}
+
+// A flat map is a vector of pairs sorted by key with unique keys.
+template <typename K, typename V, typename CK, typename CV>
+void zipInto(std::vector<std::pair<K, V>>& result, const CK& keys, const CV& vals) {
+   result.reserve(keys.size());
+   auto val = vals.begin();
+   for (const auto& key : keys) {
+      result.push_back(std::pair<K, V>(key, *val++));
+   }
+   if (!isStrictlySorted(keys)) {
+      typedef std::pair<K, V> P;
+      std::stable_sort(result.begin(), result.end(), [](const P& a, const P& b) { return a.first < b.first; });
+      // Keep the last of each run of equal keys.
+      auto out = result.begin();
+      for (auto iter = result.begin(); iter != result.end(); ++iter) {
+         auto next = iter + 1;
+         if (next == result.end() || iter->first < next->first) {
+            *out++ = std::move(*iter);
+         }
+      }
+      result.erase(out, result.end());
+   }
+}
+
+} // namespace sanity_detail
+
+// __zipmap<M>(keys, vals)__.
+// Returns a map of type M using keys, vals. M may be a std::map, a
+// std::unordered_map (capacity is reserved up front) or a flat map
+// (std::vector of key-sorted pairs). Sorted keys build a std::map in O(n).
+//
+// `zipmap<std::unordered_map<int, char>>([1,2], ['a','b']) => {1:'a', 2:'b'}`
+template <typename M, typename CK, typename CV>
+M zipmap(const CK& keys, const CV& vals) {
+   if (keys.size() != vals.size()) {
+      throw std::runtime_error("keys and vals vectors are different lengths");
+   }
+   M result;
+   sanity_detail::zipInto(result, keys, vals);
+   return result;
+}
+
 // __zipmap(keys, vals)__.
 // Returns a map using keys, vals.
-template <typename CK, typename CV, typename K, typename V>
-std::map<K, V> zipmap(const CK& keys, const CV& vals) {
-   int n = keys.size();
-   if (n != vals.size()) {
-      throw std::exception("keys and vals vectors are different lengths");
+//
+// `zipmap([1,2,3], ['a','b','c']) => {1:'a', 2:'b', 3:'c'}`
+template <typename CK, typename CV>
+auto zipmap(const CK& keys, const CV& vals) -> std::map<typename CK::value_type, typename CV::value_type> {
+   return zipmap<std::map<typename CK::value_type, typename CV::value_type>>(keys, vals);
+}
+
+// __zipmapParallel(keys, vals, nthreads)__.
+// Like zipmap, for very large inputs. The keys are sorted on nthreads
+// threads, and the sorted pairs are then linked into the map in O(n).
+template <typename CK, typename CV>
+auto zipmapParallel(const CK& keys, const CV& vals, unsigned nthreads = std::thread::hardware_concurrency())
+      -> std::map<typename CK::value_type, typename CV::value_type> {
+   typedef typename CK::value_type K;
+   typedef typename CV::value_type V;
+   if (keys.size() != vals.size()) {
+      throw std::runtime_error("keys and vals vectors are different lengths");
    }
    std::map<K, V> result;
-   for (int i = 0; i < keys.size(); ++i) {
-      result[keys[i]] = vals[i];
+   if (sanity_detail::isStrictlySorted(keys)) {
+      sanity_detail::zipInto(result, keys, vals);
+      return result;
+   }
+   std::vector<std::pair<K, V>> sorted;
+   sorted.reserve(keys.size());
+   auto val = vals.begin();
+   for (const auto& key : keys) {
+      sorted.push_back(std::pair<K, V>(key, *val++));
+   }
+   typedef std::pair<K, V> P;
+   sanity_detail::parallelStableSort(sorted, [](const P& a, const P& b) { return a.first < b.first; }, nthreads);
+   for (auto iter = sorted.begin(); iter != sorted.end(); ++iter) {
+      auto next = iter + 1;
+      if (next == sorted.end() || iter->first < next->first) {
+         result.insert(result.end(), std::move(*iter));
+      }
    }
    return result;
 }
@@ -523,140 +1069,6499 @@ template <typename K, typename V, typename F>
 std::map<K, V> mergeWith(const F& func, const std::map<K, V>& map1, const std::map<K, V>& map2) {
    std::map<K, V> result(map1);
    for (auto& kv2 : map2) {
-      result[kv2.first] = hasKey(map1, kv2.first) ? func(get(map1, kv2.first), kv2.second) : kv2.second;
+      auto iter = map1.find(kv2.first);
+      result[kv2.first] = iter != map1.end() ? func(iter->second, kv2.second) : kv2.second;
    }
    return result;
 }
 
 // __renameKeys(map, kmap)__.
 // Returns the map with the keys in kmap renamed to the vals in kmap.
+// A renamed entry replaces any entry already stored under its new key.
+// The map is copied once in O(n) and only the renamed entries are touched.
+//
+// `renameKeys({1:'a', 2:'b'}, {1:3}) => {2:'b', 3:'a'}`
 template <typename K, typename V>
 std::map<K, V> renameKeys(const std::map<K, V>& map, const std::map<K, K>& kmap) {
-   std::map<K, V> result;
-   for (auto& kv : map) {
-      if (hasKey(kmap, kv.first)) {
-         result[kmap[kv.first]] = kv.second;
-      } else {
-         result[kv.first] = kv.second;
+   std::map<K, V> result(map);
+   std::vector<std::pair<K, const V*>> renamed;
+   for (auto& rename : kmap) {
+      auto found = map.find(rename.first);
+      if (found != map.end()) {
+         renamed.push_back(std::pair<K, const V*>(rename.second, &found->second));
+         result.erase(rename.first);
       }
    }
+   for (auto& kv : renamed) {
+      result[kv.first] = *kv.second;
+   }
+   return result;
 }
 
-// ## Numerical functions.
-
-// __isEven(x)__.
-// Returns true if x is even.
-template <typename A>
-bool isEven(A x) {
-   return x % 2 == 0;
-}
-
-// __isOdd(x)__.
-// Returns true if x is odd.
-template <typename A>
-bool isOdd(A x) {
-   return !isEven(x);
+// __selectKeys(map, keys)__.
+// Returns a map containing only those entries of map whose key is in keys.
+// Sorted keys are appended to the result without searching the result tree.
+//
+// `selectKeys({1:'a', 2:'b', 3:'c'}, [1,3]) => {1:'a', 3:'c'}`
+template <typename K, typename V, typename CK>
+std::map<K, V> selectKeys(const std::map<K, V>& map, const CK& keys) {
+   std::map<K, V> result;
+   bool sorted = sanity_detail::isStrictlySorted(keys);
+   for (const auto& key : keys) {
+      auto found = map.find(key);
+      if (found != map.end()) {
+         if (sorted) {
+            result.insert(result.end(), *found);
+         } else {
+            result.insert(*found);
+         }
+      }
+   }
+   return result;
 }
 
-// __isZero(x)__.
-// Returns true if x is zero.
-template <typename A>
-bool isZero(A x) {
-   return x == 0;
-}
+// ## Persistent maps.
+//
+// A pmap is an immutable sorted map. Every "modification" returns a new
+// pmap that shares all untouched nodes with the original, so assoc and
+// dissoc cost O(log n) time and space instead of a full copy.
 
-// __isPositive(x)__.
-// Returns true if x is more than zero.
-template <typename A>
-bool isPositive(A x) {
-   return x > 0;
-}
+namespace sanity_detail {
 
-// __isNegative(x)__.
-// Returns true if x is less than zero.
-template <typename A>
-bool isNegative(A x) {
-   return x < 0;
+inline void hashCombine(size_t& seed, size_t hash) {
+   seed ^= hash + 0x9e3779b9 + (seed << 6) + (seed >> 2);
 }
 
-// __inc(x)__.
-// Increases x by 1.
-template <typename A>
-A inc(A x) {
-   return x + 1;
+// Spreads the bits of an element hash, so that sums and polynomials of
+// element hashes stay well distributed.
+inline size_t mixHash(size_t hash) {
+   uint64_t x = hash;
+   x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+   x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+   return (size_t) (x ^ (x >> 31));
 }
 
-// __dec(x)__.
-// Decreases x by 1.
-template <typename A>
-A dec(A x) {
-   return x - 1;
+template <typename T>
+size_t hashOf(const T& val) {
+   return std::hash<T>()(val);
 }
 
-// __add(a, b)__.
-// Returns a + b.
 template <typename A, typename B>
-auto add(A a, B b) -> decltype(a + b) {
-   return a + b;
+size_t hashOf(const std::pair<A, B>& entry) {
+   size_t seed = hashOf(entry.first);
+   hashCombine(seed, hashOf(entry.second));
+   return seed;
 }
 
-// __subtract(a, b)__.
-// Returns a - b.
-template <typename A, typename B>
-auto subtract(A a, B b) -> decltype(a - b) {
-   return a - b;
-}
+// A hasher for unordered containers that also accepts pairs.
+struct hashOfFunction {
+   template <typename T>
+   size_t operator()(const T& val) const { return hashOf(val); }
+};
 
-// __multiply(a, b)__.
-// Returns a * b.
-template <typename A, typename B>
-auto multiply(A a, B b) -> decltype(a * b) {
-   return a * b;
-}
+// Sequences hash as a polynomial in their element hashes, so the hash of a
+// concatenation follows from the hashes and sizes of its parts.
+const size_t seqHashBase = 31;
 
-// __divide(a, b)__.
-// Returns a / b.
-template <typename A, typename B>
-auto divide(A a, B b) -> decltype(a / b) {
-   return a / b;
+inline size_t seqHashPower(size_t n) {
+   size_t result = 1;
+   for (size_t base = seqHashBase; n; n >>= 1, base *= base) {
+      if (n & 1) {
+         result *= base;
+      }
+   }
+   return result;
 }
 
-// __modulo(a, b)__.
-// Returns a % b.
-template <typename A, typename B>
-auto modulo(A a, B b) -> decltype(a % b) {
-   return a % b;
-}
+// A hash computed on first use and shared by everyone holding the node it
+// lives in. Zero means not computed yet.
+class hashCache {
+public:
+   hashCache() : value(0) {}
+   hashCache(const hashCache&) : value(0) {}
+   hashCache& operator=(const hashCache&) { return *this; }
 
-// ## Strings
+   size_t peek() const { return value.load(std::memory_order_relaxed); }
 
-// __split(input, regex)__.
-// Split into tokens separated by regex.
-std::vector<std::string> split(const std::string& input, const std::string& regex) {
-   std::vector<std::string> result;
-   std::sregex_token_iterator iter(input.begin(), input.end(), std::regex(regex), -1);
-   std::sregex_token_iterator end;
-   for (; iter != end; ++iter) {
-      result.push_back(*iter);
+   template <typename F>
+   size_t get(const F& compute) const {
+      size_t result = peek();
+      if (result == 0) {
+         result = compute();
+         value.store(result, std::memory_order_relaxed);
+      }
+      return result;
    }
-   return result;
-}
 
-// ## I/O
+private:
+   mutable std::atomic<size_t> value;
+};
 
-// __spit(file, content)__.
-// Write a string to a file.
-void spit(const std::string& file, const std::string& content) {
-   std::ofstream out(file);
-   out << content;
-   out.close();
+// True if both hashes have been computed and differ.
+inline bool knownUnequal(const hashCache& a, const hashCache& b) {
+   size_t ha = a.peek();
+   size_t hb = b.peek();
+   return ha != 0 && hb != 0 && ha != hb;
 }
 
-// __slurp(file)__.
-// Read a file into a string.
-std::string slurp(const std::string& file) {
-   std::ifstream input("file.txt");
-   std::stringstream buffer;
-   buffer << input.rdbuf();
-   return buffer.str();
-}
+// A node of a persistent AVL tree. Entry is the stored element; KeyOf
+// extracts the key used for ordering.
+template <typename E>
+struct avlNode {
+   typedef std::shared_ptr<const avlNode> ptr;
+   avlNode(const ptr& left, const E& entry, const ptr& right)
+      : left(left), right(right), entry(entry),
+        height(1 + std::max(left ? left->height : 0, right ? right->height : 0)),
+        size(1 + (left ? left->size : 0) + (right ? right->size : 0)) {}
+   ptr left;
+   ptr right;
+   E entry;
+   int height;
+   size_t size;
+   hashCache hash;
+};
+
+struct mapKeyOf {
+   template <typename P>
+   static const typename P::first_type& get(const P& entry) { return entry.first; }
+};
+
+struct setKeyOf {
+   template <typename T>
+   static const T& get(const T& entry) { return entry; }
+};
+
+// Join-based AVL algorithms. All of them return new trees and never
+// modify existing nodes.
+template <typename E, typename KeyOf>
+struct avl {
+   typedef avlNode<E> node;
+   typedef typename node::ptr ptr;
+
+   static int height(const ptr& t) { return t ? t->height : 0; }
+   static size_t size(const ptr& t) { return t ? t->size : 0; }
+
+   static ptr make(const ptr& left, const E& entry, const ptr& right) {
+      return std::make_shared<const node>(left, entry, right);
+   }
+
+   static ptr rotateLeft(const ptr& t) {
+      const ptr& r = t->right;
+      return make(make(t->left, t->entry, r->left), r->entry, r->right);
+   }
+
+   static ptr rotateRight(const ptr& t) {
+      const ptr& l = t->left;
+      return make(l->left, l->entry, make(l->right, t->entry, t->right));
+   }
+
+   static ptr joinRight(const ptr& left, const E& entry, const ptr& right) {
+      const ptr& c = left->right;
+      if (height(c) <= height(right) + 1) {
+         ptr t = make(c, entry, right);
+         if (height(t) <= height(left->left) + 1) {
+            return make(left->left, left->entry, t);
+         }
+         return rotateLeft(make(left->left, left->entry, rotateRight(t)));
+      }
+      ptr t = joinRight(c, entry, right);
+      ptr result = make(left->left, left->entry, t);
+      return height(t) <= height(left->left) + 1 ? result : rotateLeft(result);
+   }
+
+   static ptr joinLeft(const ptr& left, const E& entry, const ptr& right) {
+      const ptr& c = right->left;
+      if (height(c) <= height(left) + 1) {
+         ptr t = make(left, entry, c);
+         if (height(t) <= height(right->right) + 1) {
+            return make(t, right->entry, right->right);
+         }
+         return rotateRight(make(rotateLeft(t), right->entry, right->right));
+      }
+      ptr t = joinLeft(left, entry, c);
+      ptr result = make(t, right->entry, right->right);
+      return height(t) <= height(right->right) + 1 ? result : rotateRight(result);
+   }
+
+   // Every key in left < key of entry < every key in right.
+   static ptr join(const ptr& left, const E& entry, const ptr& right) {
+      if (height(left) > height(right) + 1) {
+         return joinRight(left, entry, right);
+      }
+      if (height(right) > height(left) + 1) {
+         return joinLeft(left, entry, right);
+      }
+      return make(left, entry, right);
+   }
+
+   static ptr removeLast(const ptr& t, const E*& last) {
+      if (!t->right) {
+         last = &t->entry;
+         return t->left;
+      }
+      return join(t->left, t->entry, removeLast(t->right, last));
+   }
+
+   // Every key in left < every key in right.
+   static ptr join2(const ptr& left, const ptr& right) {
+      if (!left) {
+         return right;
+      }
+      const E* last = nullptr;
+      ptr rest = removeLast(left, last);
+      return join(rest, *last, right);
+   }
+
+   // Splits t into the entries less than key and those greater than key.
+   // found is set to the node holding key, if any.
+   template <typename K>
+   static void split(const ptr& t, const K& key, ptr& less, const node*& found, ptr& greater) {
+      if (!t) {
+         less = greater = ptr();
+         return;
+      }
+      const K& k = KeyOf::get(t->entry);
+      if (key < k) {
+         ptr lessRight;
+         split(t->left, key, less, found, lessRight);
+         greater = join(lessRight, t->entry, t->right);
+      } else if (k < key) {
+         ptr greaterLeft;
+         split(t->right, key, greaterLeft, found, greater);
+         less = join(t->left, t->entry, greaterLeft);
+      } else {
+         less = t->left;
+         found = t.get();
+         greater = t->right;
+      }
+   }
+
+   template <typename K>
+   static const node* find(const ptr& root, const K& key) {
+      const node* t = root.get();
+      while (t) {
+         const K& k = KeyOf::get(t->entry);
+         if (key < k) {
+            t = t->left.get();
+         } else if (k < key) {
+            t = t->right.get();
+         } else {
+            return t;
+         }
+      }
+      return nullptr;
+   }
+
+   // Inserts entry, replacing any entry with an equal key.
+   static ptr insert(const ptr& t, const E& entry) {
+      if (!t) {
+         return make(ptr(), entry, ptr());
+      }
+      const auto& key = KeyOf::get(entry);
+      const auto& k = KeyOf::get(t->entry);
+      if (key < k) {
+         return join(insert(t->left, entry), t->entry, t->right);
+      } else if (k < key) {
+         return join(t->left, t->entry, insert(t->right, entry));
+      }
+      return make(t->left, entry, t->right);
+   }
+
+   template <typename K>
+   static ptr erase(const ptr& t, const K& key) {
+      if (!t) {
+         return t;
+      }
+      const K& k = KeyOf::get(t->entry);
+      if (key < k) {
+         ptr left = erase(t->left, key);
+         return left == t->left ? t : join(left, t->entry, t->right);
+      } else if (k < key) {
+         ptr right = erase(t->right, key);
+         return right == t->right ? t : join(t->left, t->entry, right);
+      }
+      return join2(t->left, t->right);
+   }
+
+   // An order-independent sum over the entries, so equal trees of any
+   // shape hash alike and an updated tree rehashes only its new path.
+   static size_t hash(const ptr& t) {
+      if (!t) {
+         return 0;
+      }
+      return t->hash.get([&t]() { return mixHash(hashOf(t->entry)) + hash(t->left) + hash(t->right); });
+   }
+
+   // Builds a perfectly balanced tree from n entries in key order, in O(n).
+   template <typename IT>
+   static ptr fromSorted(IT& iter, size_t n) {
+      if (n == 0) {
+         return ptr();
+      }
+      ptr left = fromSorted(iter, n / 2);
+      const E& entry = *iter;
+      ++iter;
+      ptr right = fromSorted(iter, n - n / 2 - 1);
+      return make(left, entry, right);
+   }
+};
+
+// In-order iterator over an avl tree, holding the path from the root.
+template <typename E>
+class avlIterator {
+public:
+   typedef std::forward_iterator_tag iterator_category;
+   typedef E value_type;
+   typedef std::ptrdiff_t difference_type;
+   typedef const E* pointer;
+   typedef const E& reference;
+
+   avlIterator() {}
+   explicit avlIterator(const avlNode<E>* root) { pushLeft(root); }
+
+   reference operator*() const { return path.back()->entry; }
+   pointer operator->() const { return &path.back()->entry; }
+   avlIterator& operator++() {
+      const avlNode<E>* t = path.back();
+      path.pop_back();
+      pushLeft(t->right.get());
+      return *this;
+   }
+   avlIterator operator++(int) {
+      avlIterator result(*this);
+      ++*this;
+      return result;
+   }
+   bool operator==(const avlIterator& other) const { return path == other.path; }
+   bool operator!=(const avlIterator& other) const { return path != other.path; }
+
+   // The node holding the current entry.
+   const avlNode<E>* node() const { return path.back(); }
+
+   // Steps past the current entry and its whole right subtree.
+   void skipRight() { path.pop_back(); }
+
+private:
+   void pushLeft(const avlNode<E>* t) {
+      for (; t; t = t->left.get()) {
+         path.push_back(t);
+      }
+   }
+   std::vector<const avlNode<E>*> path;
+};
+
+// Compares two trees of equal size entry by entry. When both walks reach
+// the same node, that node's right subtree is shared and is skipped.
+template <typename E>
+bool avlEqual(const std::shared_ptr<const avlNode<E>>& a, const std::shared_ptr<const avlNode<E>>& b) {
+   if (a == b) {
+      return true;
+   }
+   if (!a || !b || a->size != b->size || knownUnequal(a->hash, b->hash)) {
+      return false;
+   }
+   avlIterator<E> i(a.get()), j(b.get()), end;
+   while (i != end) {
+      if (i.node() == j.node()) {
+         i.skipRight();
+         j.skipRight();
+      } else {
+         if (!(*i == *j)) {
+            return false;
+         }
+         ++i;
+         ++j;
+      }
+   }
+   return true;
+}
+
+} // namespace sanity_detail
+
+// __pmap<K, V>__.
+// A persistent sorted map from K to V. Iterates over std::pair<K, V> in key order.
+template <typename K, typename V>
+class pmap {
+public:
+   typedef K key_type;
+   typedef V mapped_type;
+   typedef std::pair<K, V> value_type;
+   typedef sanity_detail::avl<value_type, sanity_detail::mapKeyOf> tree;
+   typedef typename tree::ptr nodePtr;
+   typedef sanity_detail::avlIterator<value_type> const_iterator;
+   typedef const_iterator iterator;
+
+   pmap() {}
+   explicit pmap(const nodePtr& root) : root(root) {}
+   pmap(std::initializer_list<value_type> entries) {
+      for (auto& entry : entries) {
+         root = tree::insert(root, entry);
+      }
+   }
+
+   size_t size() const { return tree::size(root); }
+   bool empty() const { return !root; }
+   const_iterator begin() const { return const_iterator(root.get()); }
+   const_iterator end() const { return const_iterator(); }
+   const nodePtr& rootNode() const { return root; }
+
+   // Returns a pointer to the val stored under key, or nullptr.
+   const V* valAt(const K& key) const {
+      auto t = tree::find(root, key);
+      return t ? &t->entry.second : nullptr;
+   }
+
+   pmap assoc(const K& key, const V& val) const {
+      return pmap(tree::insert(root, value_type(key, val)));
+   }
+
+   pmap dissoc(const K& key) const {
+      return pmap(tree::erase(root, key));
+   }
+
+   // Cached after the first call; O(log n) for a pmap derived from a hashed one.
+   size_t hash() const { return tree::hash(root); }
+
+   bool operator==(const pmap& other) const { return sanity_detail::avlEqual(root, other.root); }
+   bool operator!=(const pmap& other) const { return !(*this == other); }
+
+private:
+   nodePtr root;
+};
+
+// __hasKey(pmap, key)__.
+// Returns true if the pmap contains a key.
+template <typename K, typename V>
+bool hasKey(const pmap<K, V>& map, const typename sanity_detail::nonDeduced<K>::type& key) {
+   return map.valAt(key) != nullptr;
+}
+
+// __get(pmap, key, notFound)__.
+// Gets the val in the pmap corresponding to key, or notFound.
+template <typename K, typename V>
+V get(const pmap<K, V>& map, const typename sanity_detail::nonDeduced<K>::type& key,
+      const typename sanity_detail::nonDeduced<V>::type& notFound) {
+   const V* val = map.valAt(key);
+   return val ? *val : notFound;
+}
+
+// __assoc(pmap, key, val)__.
+// Adds a key, val pair to a pmap in O(log n).
+template <typename K, typename V>
+pmap<K, V> assoc(const pmap<K, V>& map, const typename sanity_detail::nonDeduced<K>::type& key,
+                 const typename sanity_detail::nonDeduced<V>::type& val) {
+   return map.assoc(key, val);
+}
+
+// __dissoc(pmap, key)__.
+// Removes a key, val pair from a pmap in O(log n).
+template <typename K, typename V>
+pmap<K, V> dissoc(const pmap<K, V>& map, const typename sanity_detail::nonDeduced<K>::type& key) {
+   return map.dissoc(key);
+}
+
+// __keys(pmap)__.
+// Returns the keys from a pmap.
+template <typename K, typename V>
+std::vector<K> keys(const pmap<K, V>& m) {
+   std::vector<K> result;
+   result.reserve(m.size());
+   for (auto& kv : m) {
+      result.push_back(kv.first);
+   }
+   return result;
+}
+
+// __vals(pmap)__.
+// Returns the vals from a pmap.
+template <typename K, typename V>
+std::vector<V> vals(const pmap<K, V>& m) {
+   std::vector<V> result;
+   result.reserve(m.size());
+   for (auto& kv : m) {
+      result.push_back(kv.second);
+   }
+   return result;
+}
+
+// __renameKeys(pmap, kmap)__.
+// Returns the pmap with the keys in kmap renamed to the vals in kmap.
+// Only the renamed entries are touched: O(k log n) for k renames.
+template <typename K, typename V, typename KM>
+pmap<K, V> renameKeys(const pmap<K, V>& map, const KM& kmap) {
+   std::vector<std::pair<K, V>> renamed;
+   pmap<K, V> result(map);
+   for (auto& rename : kmap) {
+      const V* val = map.valAt(rename.first);
+      if (val) {
+         renamed.push_back(std::pair<K, V>(rename.second, *val));
+         result = result.dissoc(rename.first);
+      }
+   }
+   for (auto& kv : renamed) {
+      result = result.assoc(kv.first, kv.second);
+   }
+   return result;
+}
+
+// __selectKeys(pmap, keys)__.
+// Returns a pmap containing only those entries whose key is in keys.
+// The result is built bottom-up in O(k) once the k matches are found.
+template <typename K, typename V, typename CK>
+pmap<K, V> selectKeys(const pmap<K, V>& map, const CK& keys) {
+   typedef std::pair<K, V> P;
+   std::vector<P> selected;
+   for (const auto& key : keys) {
+      const V* val = map.valAt(key);
+      if (val) {
+         selected.push_back(P(key, *val));
+      }
+   }
+   if (!sanity_detail::isStrictlySorted(keys)) {
+      std::sort(selected.begin(), selected.end(), [](const P& a, const P& b) { return a.first < b.first; });
+      selected.erase(std::unique(selected.begin(), selected.end(),
+                                 [](const P& a, const P& b) { return !(a.first < b.first) && !(b.first < a.first); }),
+                     selected.end());
+   }
+   auto iter = selected.cbegin();
+   return pmap<K, V>(pmap<K, V>::tree::fromSorted(iter, selected.size()));
+}
+
+// ## Persistent sequences.
+
+namespace sanity_detail {
+
+// A 2-3 finger tree annotated with sizes (Hinze & Paterson). Elements sit
+// in leaf nodes; deeper levels of the tree hold 2-3 nodes of the level
+// above. Adding or removing at either end touches O(1) nodes amortized;
+// splitting and concatenating take O(log n).
+template <typename T>
+struct fingerTree {
+   struct node {
+      node(size_t size, unsigned char count) : size(size), count(count) {}
+      size_t size;
+      // 0 for a leaf holding an element, else the number of children.
+      unsigned char count;
+   };
+   typedef std::shared_ptr<const node> nodePtr;
+
+   struct leaf : node {
+      explicit leaf(const T& val) : node(1, 0), val(val) {}
+      T val;
+   };
+
+   struct branch : node {
+      branch(const nodePtr& a, const nodePtr& b) : node(a->size + b->size, 2) {
+         kids[0] = a;
+         kids[1] = b;
+      }
+      branch(const nodePtr& a, const nodePtr& b, const nodePtr& c) : node(a->size + b->size + c->size, 3) {
+         kids[0] = a;
+         kids[1] = b;
+         kids[2] = c;
+      }
+      nodePtr kids[3];
+   };
+
+   // One to four nodes at an end of a tree.
+   struct digit {
+      digit() : count(0) {}
+      size_t size() const {
+         size_t result = 0;
+         for (unsigned i = 0; i < count; ++i) {
+            result += items[i]->size;
+         }
+         return result;
+      }
+      void pushBack(const nodePtr& item) { items[count++] = item; }
+      nodePtr items[4];
+      unsigned count;
+   };
+
+   struct tree;
+   typedef std::shared_ptr<const tree> treePtr;
+
+   // An empty tree is a null treePtr. A single tree has only a prefix of
+   // one node; a deep tree has prefix, middle and suffix.
+   struct tree {
+      tree(const digit& prefix, const treePtr& middle, const digit& suffix)
+         : size(prefix.size() + (middle ? middle->size : 0) + suffix.size()), prefix(prefix), middle(middle), suffix(suffix) {}
+      bool single() const { return suffix.count == 0; }
+      size_t size;
+      digit prefix;
+      treePtr middle;
+      digit suffix;
+      hashCache hash;
+   };
+
+   static size_t sizeOf(const treePtr& t) { return t ? t->size : 0; }
+
+   static const T& value(const nodePtr& n) { return static_cast<const leaf*>(n.get())->val; }
+   static const branch& asBranch(const nodePtr& n) { return *static_cast<const branch*>(n.get()); }
+
+   static nodePtr makeLeaf(const T& val) { return std::make_shared<const leaf>(val); }
+
+   static digit makeDigit(const nodePtr* items, unsigned count) {
+      digit d;
+      for (unsigned i = 0; i < count; ++i) {
+         d.pushBack(items[i]);
+      }
+      return d;
+   }
+
+   static digit nodeToDigit(const nodePtr& n) {
+      return makeDigit(asBranch(n).kids, n->count);
+   }
+
+   static treePtr single(const nodePtr& item) {
+      return std::make_shared<const tree>(makeDigit(&item, 1), treePtr(), digit());
+   }
+
+   static treePtr deep(const digit& prefix, const treePtr& middle, const digit& suffix) {
+      return std::make_shared<const tree>(prefix, middle, suffix);
+   }
+
+   static treePtr digitToTree(const digit& d) {
+      if (d.count == 0) {
+         return treePtr();
+      }
+      if (d.count == 1) {
+         return single(d.items[0]);
+      }
+      unsigned half = d.count / 2;
+      return deep(makeDigit(d.items, half), treePtr(), makeDigit(d.items + half, d.count - half));
+   }
+
+   static treePtr pushFront(const treePtr& t, const nodePtr& item) {
+      if (!t) {
+         return single(item);
+      }
+      if (t->single()) {
+         return deep(makeDigit(&item, 1), treePtr(), t->prefix);
+      }
+      const digit& pr = t->prefix;
+      if (pr.count == 4) {
+         nodePtr front[2] = { item, pr.items[0] };
+         nodePtr moved = std::make_shared<const branch>(pr.items[1], pr.items[2], pr.items[3]);
+         return deep(makeDigit(front, 2), pushFront(t->middle, moved), t->suffix);
+      }
+      digit d;
+      d.pushBack(item);
+      for (unsigned i = 0; i < pr.count; ++i) {
+         d.pushBack(pr.items[i]);
+      }
+      return deep(d, t->middle, t->suffix);
+   }
+
+   static treePtr pushBack(const treePtr& t, const nodePtr& item) {
+      if (!t) {
+         return single(item);
+      }
+      if (t->single()) {
+         return deep(t->prefix, treePtr(), makeDigit(&item, 1));
+      }
+      const digit& sf = t->suffix;
+      if (sf.count == 4) {
+         nodePtr back[2] = { sf.items[3], item };
+         nodePtr moved = std::make_shared<const branch>(sf.items[0], sf.items[1], sf.items[2]);
+         return deep(t->prefix, pushBack(t->middle, moved), makeDigit(back, 2));
+      }
+      digit d = sf;
+      d.pushBack(item);
+      return deep(t->prefix, t->middle, d);
+   }
+
+   // A deep tree whose prefix may be empty.
+   static treePtr deepLeft(const digit& prefix, const treePtr& middle, const digit& suffix) {
+      if (prefix.count > 0) {
+         return deep(prefix, middle, suffix);
+      }
+      if (!middle) {
+         return digitToTree(suffix);
+      }
+      return deep(nodeToDigit(front(middle)), popFront(middle), suffix);
+   }
+
+   // A deep tree whose suffix may be empty.
+   static treePtr deepRight(const digit& prefix, const treePtr& middle, const digit& suffix) {
+      if (suffix.count > 0) {
+         return deep(prefix, middle, suffix);
+      }
+      if (!middle) {
+         return digitToTree(prefix);
+      }
+      return deep(prefix, popBack(middle), nodeToDigit(back(middle)));
+   }
+
+   static const nodePtr& front(const treePtr& t) { return t->prefix.items[0]; }
+   static const nodePtr& back(const treePtr& t) { return t->single() ? t->prefix.items[0] : t->suffix.items[t->suffix.count - 1]; }
+
+   static treePtr popFront(const treePtr& t) {
+      if (t->single()) {
+         return treePtr();
+      }
+      return deepLeft(makeDigit(t->prefix.items + 1, t->prefix.count - 1), t->middle, t->suffix);
+   }
+
+   static treePtr popBack(const treePtr& t) {
+      if (t->single()) {
+         return treePtr();
+      }
+      return deepRight(t->prefix, t->middle, makeDigit(t->suffix.items, t->suffix.count - 1));
+   }
+
+   static void appendItems(std::vector<nodePtr>& items, const digit& d) {
+      items.insert(items.end(), d.items, d.items + d.count);
+   }
+
+   // Packs 2 to 12 nodes into 2-3 nodes.
+   static std::vector<nodePtr> nodes(const std::vector<nodePtr>& items) {
+      std::vector<nodePtr> result;
+      size_t i = 0;
+      size_t n = items.size();
+      while (n - i > 4) {
+         result.push_back(std::make_shared<const branch>(items[i], items[i + 1], items[i + 2]));
+         i += 3;
+      }
+      if (n - i == 4) {
+         result.push_back(std::make_shared<const branch>(items[i], items[i + 1]));
+         result.push_back(std::make_shared<const branch>(items[i + 2], items[i + 3]));
+      } else if (n - i == 3) {
+         result.push_back(std::make_shared<const branch>(items[i], items[i + 1], items[i + 2]));
+      } else {
+         result.push_back(std::make_shared<const branch>(items[i], items[i + 1]));
+      }
+      return result;
+   }
+
+   // Concatenates left, the nodes in between, and right.
+   static treePtr append(const treePtr& left, const std::vector<nodePtr>& between, const treePtr& right) {
+      if (!left) {
+         treePtr result = right;
+         for (auto iter = between.rbegin(); iter != between.rend(); ++iter) {
+            result = pushFront(result, *iter);
+         }
+         return result;
+      }
+      if (!right) {
+         treePtr result = left;
+         for (const auto& item : between) {
+            result = pushBack(result, item);
+         }
+         return result;
+      }
+      if (left->single()) {
+         return pushFront(append(treePtr(), between, right), left->prefix.items[0]);
+      }
+      if (right->single()) {
+         return pushBack(append(left, between, treePtr()), right->prefix.items[0]);
+      }
+      std::vector<nodePtr> items;
+      appendItems(items, left->suffix);
+      items.insert(items.end(), between.begin(), between.end());
+      appendItems(items, right->prefix);
+      return deep(left->prefix, append(left->middle, nodes(items), right->middle), right->suffix);
+   }
+
+   // Splits a digit around the item containing position i.
+   static void splitDigit(size_t i, const digit& d, digit& left, nodePtr& item, digit& right) {
+      unsigned k = 0;
+      for (; k + 1 < d.count && i >= d.items[k]->size; ++k) {
+         i -= d.items[k]->size;
+      }
+      left = makeDigit(d.items, k);
+      item = d.items[k];
+      right = makeDigit(d.items + k + 1, d.count - k - 1);
+   }
+
+   // Splits t into the items before the one containing position i, that
+   // item, and the items after it. t must not be empty.
+   static void splitTree(size_t i, const treePtr& t, treePtr& left, nodePtr& item, treePtr& right) {
+      digit l, r;
+      if (t->single()) {
+         left = right = treePtr();
+         item = t->prefix.items[0];
+         return;
+      }
+      size_t prefixSize = t->prefix.size();
+      if (i < prefixSize) {
+         splitDigit(i, t->prefix, l, item, r);
+         left = digitToTree(l);
+         right = deepLeft(r, t->middle, t->suffix);
+         return;
+      }
+      size_t middleEnd = prefixSize + sizeOf(t->middle);
+      if (i < middleEnd) {
+         treePtr middleLeft, middleRight;
+         nodePtr middleItem;
+         splitTree(i - prefixSize, t->middle, middleLeft, middleItem, middleRight);
+         splitDigit(i - prefixSize - sizeOf(middleLeft), nodeToDigit(middleItem), l, item, r);
+         left = deepRight(t->prefix, middleLeft, l);
+         right = deepLeft(r, middleRight, t->suffix);
+         return;
+      }
+      splitDigit(i - middleEnd, t->suffix, l, item, r);
+      left = deepRight(t->prefix, t->middle, l);
+      right = digitToTree(r);
+   }
+
+   // Returns the element at position i, without building any nodes.
+   static const T& lookup(const treePtr& root, size_t i) {
+      const tree* t = root.get();
+      const node* n = nullptr;
+      while (!n) {
+         const digit* d;
+         if (t->single() || i < t->prefix.size()) {
+            d = &t->prefix;
+         } else if (i < t->prefix.size() + sizeOf(t->middle)) {
+            i -= t->prefix.size();
+            t = t->middle.get();
+            continue;
+         } else {
+            i -= t->prefix.size() + sizeOf(t->middle);
+            d = &t->suffix;
+         }
+         unsigned k = 0;
+         for (; i >= d->items[k]->size; ++k) {
+            i -= d->items[k]->size;
+         }
+         n = d->items[k].get();
+      }
+      while (n->count > 0) {
+         const branch* b = static_cast<const branch*>(n);
+         unsigned k = 0;
+         for (; i >= b->kids[k]->size; ++k) {
+            i -= b->kids[k]->size;
+         }
+         n = b->kids[k].get();
+      }
+      return static_cast<const leaf*>(n)->val;
+   }
+};
+
+// In-order iterator over a finger tree. Pending trees and nodes are kept
+// on a stack, so each step costs O(1) amortized.
+template <typename T>
+class fingerTreeIterator {
+public:
+   typedef std::forward_iterator_tag iterator_category;
+   typedef T value_type;
+   typedef std::ptrdiff_t difference_type;
+   typedef const T* pointer;
+   typedef const T& reference;
+
+   fingerTreeIterator() {}
+   explicit fingerTreeIterator(const typename fingerTree<T>::tree* t) {
+      if (t) {
+         pending.push_back(frame(t, nullptr));
+         advance();
+      }
+   }
+
+   reference operator*() const { return static_cast<const typename fingerTree<T>::leaf*>(pending.back().second)->val; }
+   pointer operator->() const { return &**this; }
+   fingerTreeIterator& operator++() {
+      pending.pop_back();
+      advance();
+      return *this;
+   }
+   fingerTreeIterator operator++(int) {
+      fingerTreeIterator result(*this);
+      ++*this;
+      return result;
+   }
+   bool operator==(const fingerTreeIterator& other) const { return pending == other.pending; }
+   bool operator!=(const fingerTreeIterator& other) const { return pending != other.pending; }
+
+private:
+   typedef std::pair<const typename fingerTree<T>::tree*, const typename fingerTree<T>::node*> frame;
+
+   // Expands the top of the stack until it is a leaf.
+   void advance() {
+      while (!pending.empty()) {
+         frame top = pending.back();
+         if (top.second && top.second->count == 0) {
+            return;
+         }
+         pending.pop_back();
+         if (top.first) {
+            const typename fingerTree<T>::tree* t = top.first;
+            for (unsigned i = t->suffix.count; i > 0; --i) {
+               pending.push_back(frame(nullptr, t->suffix.items[i - 1].get()));
+            }
+            if (t->middle) {
+               pending.push_back(frame(t->middle.get(), nullptr));
+            }
+            for (unsigned i = t->prefix.count; i > 0; --i) {
+               pending.push_back(frame(nullptr, t->prefix.items[i - 1].get()));
+            }
+         } else {
+            const typename fingerTree<T>::branch* b = static_cast<const typename fingerTree<T>::branch*>(top.second);
+            for (unsigned i = b->count; i > 0; --i) {
+               pending.push_back(frame(nullptr, b->kids[i - 1].get()));
+            }
+         }
+      }
+   }
+
+   std::vector<frame> pending;
+};
+
+} // namespace sanity_detail
+
+// __pdeque<T>__.
+// A persistent double-ended sequence. cons, conj, first, last, rest and
+// butlast take amortized O(1) time; nth, splitAt and concat take O(log n).
+// Versions share structure, so every operation leaves the original intact.
+template <typename T>
+class pdeque {
+public:
+   typedef T value_type;
+   typedef sanity_detail::fingerTree<T> ft;
+   typedef sanity_detail::fingerTreeIterator<T> const_iterator;
+   typedef const_iterator iterator;
+
+   pdeque() {}
+   pdeque(std::initializer_list<T> elems) {
+      for (const auto& elem : elems) {
+         root = ft::pushBack(root, ft::makeLeaf(elem));
+      }
+   }
+   template <typename IT>
+   pdeque(IT begin, IT end) {
+      for (; begin != end; ++begin) {
+         root = ft::pushBack(root, ft::makeLeaf(*begin));
+      }
+   }
+
+   size_t size() const { return ft::sizeOf(root); }
+   bool empty() const { return !root; }
+   const_iterator begin() const { return const_iterator(root.get()); }
+   const_iterator end() const { return const_iterator(); }
+
+   const T& front() const {
+      checkNotEmpty();
+      return ft::value(ft::front(root));
+   }
+   const T& back() const {
+      checkNotEmpty();
+      return ft::value(ft::back(root));
+   }
+   const T& operator[](size_t i) const { return ft::lookup(root, i); }
+
+   pdeque pushFront(const T& val) const { return pdeque(ft::pushFront(root, ft::makeLeaf(val))); }
+   pdeque pushBack(const T& val) const { return pdeque(ft::pushBack(root, ft::makeLeaf(val))); }
+   pdeque popFront() const {
+      checkNotEmpty();
+      return pdeque(ft::popFront(root));
+   }
+   pdeque popBack() const {
+      checkNotEmpty();
+      return pdeque(ft::popBack(root));
+   }
+
+   // Returns the first n elements and the rest.
+   std::pair<pdeque, pdeque> splitAt(size_t n) const {
+      if (n == 0) {
+         return std::make_pair(pdeque(), *this);
+      }
+      if (n >= size()) {
+         return std::make_pair(*this, pdeque());
+      }
+      typename ft::treePtr left, right;
+      typename ft::nodePtr item;
+      ft::splitTree(n, root, left, item, right);
+      return std::make_pair(pdeque(left), pdeque(ft::pushFront(right, item)));
+   }
+
+   pdeque concat(const pdeque& other) const {
+      return pdeque(ft::append(root, std::vector<typename ft::nodePtr>(), other.root));
+   }
+
+   // Cached in the root after the first call.
+   size_t hash() const {
+      if (!root) {
+         return 0;
+      }
+      return root->hash.get([this]() {
+         size_t result = 0;
+         for (const auto& elem : *this) {
+            result = result * sanity_detail::seqHashBase + sanity_detail::mixHash(sanity_detail::hashOf(elem));
+         }
+         return result;
+      });
+   }
+
+   bool operator==(const pdeque& other) const {
+      if (root == other.root) {
+         return true;
+      }
+      if (size() != other.size() || sanity_detail::knownUnequal(root->hash, other.root->hash)) {
+         return false;
+      }
+      return std::equal(begin(), end(), other.begin());
+   }
+   bool operator!=(const pdeque& other) const { return !(*this == other); }
+
+private:
+   explicit pdeque(const typename ft::treePtr& root) : root(root) {}
+
+   void checkNotEmpty() const {
+      if (!root) {
+         throw std::out_of_range("pdeque is empty");
+      }
+   }
+
+   typename ft::treePtr root;
+};
+
+// __first(pdeque)__.
+// Returns the first element of a pdeque in O(1).
+template <typename T>
+T first(const pdeque<T>& coll) {
+   return coll.front();
+}
+
+// __last(pdeque)__.
+// Returns the last element of a pdeque in O(1).
+template <typename T>
+T last(const pdeque<T>& coll) {
+   return coll.back();
+}
+
+// __rest(pdeque)__.
+// Returns all but the first element of a pdeque, in amortized O(1).
+template <typename T>
+pdeque<T> rest(const pdeque<T>& coll) {
+   return coll.empty() ? coll : coll.popFront();
+}
+
+// __butlast(pdeque)__.
+// Returns all but the last element of a pdeque, in amortized O(1).
+template <typename T>
+pdeque<T> butlast(const pdeque<T>& coll) {
+   return coll.empty() ? coll : coll.popBack();
+}
+
+// __cons(pdeque, item)__.
+// Returns a pdeque with item added at the front, in amortized O(1).
+template <typename T>
+pdeque<T> cons(const pdeque<T>& coll, const T& item) {
+   return coll.pushFront(item);
+}
+
+// __conj(pdeque, item)__.
+// Returns a pdeque with item added at the back, in amortized O(1).
+template <typename T>
+pdeque<T> conj(const pdeque<T>& coll, const T& item) {
+   return coll.pushBack(item);
+}
+
+// __nth(pdeque, index)__.
+// Returns the element at index in O(log n).
+template <typename T>
+T nth(const pdeque<T>& coll, long index) {
+   return coll[index];
+}
+
+// __concat(pdeque1, pdeque2)__.
+// Concatenates two pdeques in O(log n).
+template <typename T>
+pdeque<T> concat(const pdeque<T>& coll1, const pdeque<T>& coll2) {
+   return coll1.concat(coll2);
+}
+
+// __take(pdeque, n)__.
+// Returns the first n items of a pdeque in O(log n).
+template <typename T>
+pdeque<T> take(const pdeque<T>& coll, long n) {
+   return coll.splitAt(std::max(0L, n)).first;
+}
+
+// __drop(pdeque, n)__.
+// Returns a pdeque with the first n items removed, in O(log n).
+template <typename T>
+pdeque<T> drop(const pdeque<T>& coll, long n) {
+   return coll.splitAt(std::max(0L, n)).second;
+}
+
+namespace sanity_detail {
+
+// A relaxed radix balanced (RRB) tree. Leaves hold up to rrbWidth
+// elements and internal nodes up to rrbWidth children, with all leaves at
+// the same depth. Every internal node keeps the cumulative sizes of its
+// children, so nodes need not be full and two trees can be joined by
+// linking them along their facing spines, rebalancing the nodes around
+// the join so the tree stays within a few steps of dense.
+const size_t rrbWidth = 32;
+
+// How many more children than strictly needed a node near a join may keep.
+const size_t rrbExtraSteps = 2;
+
+template <typename T>
+struct rrb {
+   struct node;
+   typedef std::shared_ptr<const node> ptr;
+
+   struct node {
+      size_t size;
+      std::vector<T> elems;
+      std::vector<ptr> kids;
+      std::vector<size_t> sizes;
+      hashCache hash;
+   };
+
+   static ptr leaf(std::vector<T> elems) {
+      auto n = std::make_shared<node>();
+      n->size = elems.size();
+      n->elems = std::move(elems);
+      return n;
+   }
+
+   static ptr branch(std::vector<ptr> kids) {
+      auto n = std::make_shared<node>();
+      size_t total = 0;
+      for (const auto& kid : kids) {
+         total += kid->size;
+         n->sizes.push_back(total);
+      }
+      n->size = total;
+      n->kids = std::move(kids);
+      return n;
+   }
+
+   static size_t size(const ptr& t) { return t ? t->size : 0; }
+
+   // The child holding position i; i becomes the position within it.
+   static size_t childFor(const node& n, size_t& i) {
+      size_t k = std::upper_bound(n.sizes.begin(), n.sizes.end(), i) - n.sizes.begin();
+      if (k > 0) {
+         i -= n.sizes[k - 1];
+      }
+      return k;
+   }
+
+   static const T& lookup(const node* n, size_t i) {
+      while (!n->kids.empty()) {
+         size_t k = childFor(*n, i);
+         n = n->kids[k].get();
+      }
+      return n->elems[i];
+   }
+
+   static ptr update(const ptr& n, size_t i, const T& val) {
+      if (n->kids.empty()) {
+         std::vector<T> elems(n->elems);
+         elems[i] = val;
+         return leaf(std::move(elems));
+      }
+      size_t k = childFor(*n, i);
+      std::vector<ptr> kids(n->kids);
+      kids[k] = update(kids[k], i, val);
+      return branch(std::move(kids));
+   }
+
+   // The elements of a leaf or the children of a branch.
+   static size_t slots(const node& n) { return n.kids.empty() ? n.elems.size() : n.kids.size(); }
+
+   // Sibling nodes of one height, redistributed so there are at most
+   // rrbExtraSteps more of them than their slots strictly need. This
+   // keeps lookups within a few extra steps of a dense tree's however
+   // often it is split and joined. The leftmost node that is not full is
+   // spread over the nodes after it until one fewer node is needed; nodes
+   // whose slots do not move are reused as they are.
+   static std::vector<ptr> rebalance(const std::vector<ptr>& nodes) {
+      std::vector<size_t> sizes;
+      size_t total = 0;
+      for (const auto& n : nodes) {
+         sizes.push_back(slots(*n));
+         total += sizes.back();
+      }
+      std::vector<size_t> plan(sizes);
+      size_t optimal = (total + rrbWidth - 1) / rrbWidth;
+      while (plan.size() > optimal + rrbExtraSteps) {
+         size_t i = 0;
+         while (plan[i] == rrbWidth) {
+            ++i;
+         }
+         // Had the slots from i on all filled whole nodes, fewer nodes
+         // would not be needed, so plan[i + 1] exists while carry > 0.
+         for (size_t carry = plan[i]; carry > 0; ++i) {
+            size_t merged = std::min(carry + plan[i + 1], rrbWidth);
+            carry = carry + plan[i + 1] - merged;
+            plan[i] = merged;
+         }
+         plan.erase(plan.begin() + i);
+      }
+      if (plan == sizes) {
+         return nodes;
+      }
+      std::vector<ptr> result;
+      size_t from = 0;
+      size_t within = 0;
+      for (size_t target : plan) {
+         if (within == 0 && sizes[from] == target) {
+            result.push_back(nodes[from++]);
+            continue;
+         }
+         std::vector<T> elems;
+         std::vector<ptr> kids;
+         for (size_t need = target; need > 0;) {
+            const node& n = *nodes[from];
+            size_t taken = std::min(need, sizes[from] - within);
+            if (n.kids.empty()) {
+               elems.insert(elems.end(), n.elems.begin() + within, n.elems.begin() + within + taken);
+            } else {
+               kids.insert(kids.end(), n.kids.begin() + within, n.kids.begin() + within + taken);
+            }
+            need -= taken;
+            within += taken;
+            if (within == sizes[from]) {
+               ++from;
+               within = 0;
+            }
+         }
+         result.push_back(kids.empty() ? leaf(std::move(elems)) : branch(std::move(kids)));
+      }
+      return result;
+   }
+
+   // Rebalances the children below a join and packs them into one or two
+   // parents.
+   static std::vector<ptr> joinKids(std::vector<ptr> kids) {
+      kids = rebalance(kids);
+      std::vector<ptr> result;
+      if (kids.size() <= rrbWidth) {
+         result.push_back(branch(std::move(kids)));
+      } else {
+         result.push_back(branch(std::vector<ptr>(kids.begin(), kids.begin() + rrbWidth)));
+         result.push_back(branch(std::vector<ptr>(kids.begin() + rrbWidth, kids.end())));
+      }
+      return result;
+   }
+
+   // Joins left (height hl) and right (height hr) along their facing
+   // spines. Returns one or two nodes of height max(hl, hr); at every
+   // level on the way up, the children around the join are rebalanced.
+   static std::vector<ptr> join(const ptr& left, int hl, const ptr& right, int hr) {
+      std::vector<ptr> kids;
+      if (hl > hr) {
+         kids.assign(left->kids.begin(), left->kids.end() - 1);
+         std::vector<ptr> joined = join(left->kids.back(), hl - 1, right, hr);
+         kids.insert(kids.end(), joined.begin(), joined.end());
+      } else if (hl < hr) {
+         kids = join(left, hl, right->kids.front(), hr - 1);
+         kids.insert(kids.end(), right->kids.begin() + 1, right->kids.end());
+      } else if (hl == 0) {
+         if (left->elems.size() + right->elems.size() <= rrbWidth) {
+            std::vector<T> elems(left->elems);
+            elems.insert(elems.end(), right->elems.begin(), right->elems.end());
+            return std::vector<ptr>(1, leaf(std::move(elems)));
+         }
+         return std::vector<ptr>{left, right};
+      } else {
+         kids.assign(left->kids.begin(), left->kids.end() - 1);
+         std::vector<ptr> joined = join(left->kids.back(), hl - 1, right->kids.front(), hr - 1);
+         kids.insert(kids.end(), joined.begin(), joined.end());
+         kids.insert(kids.end(), right->kids.begin() + 1, right->kids.end());
+      }
+      return joinKids(std::move(kids));
+   }
+
+   static void concat(const ptr& left, int hl, const ptr& right, int hr, ptr& result, int& height) {
+      if (!left || !right) {
+         result = left ? left : right;
+         height = left ? hl : hr;
+         return;
+      }
+      std::vector<ptr> parts = join(left, hl, right, hr);
+      height = std::max(hl, hr);
+      if (parts.size() == 1) {
+         result = parts[0];
+      } else {
+         result = branch(std::move(parts));
+         ++height;
+      }
+   }
+
+   // Splits n into its first i elements and the rest, both of the same height.
+   static void split(const ptr& n, size_t i, ptr& left, ptr& right) {
+      if (i == 0) {
+         left = ptr();
+         right = n;
+         return;
+      }
+      if (i >= n->size) {
+         left = n;
+         right = ptr();
+         return;
+      }
+      if (n->kids.empty()) {
+         left = leaf(std::vector<T>(n->elems.begin(), n->elems.begin() + i));
+         right = leaf(std::vector<T>(n->elems.begin() + i, n->elems.end()));
+         return;
+      }
+      size_t k = childFor(*n, i);
+      ptr childLeft, childRight;
+      split(n->kids[k], i, childLeft, childRight);
+      std::vector<ptr> leftKids(n->kids.begin(), n->kids.begin() + k);
+      std::vector<ptr> rightKids;
+      if (childLeft) {
+         leftKids.push_back(childLeft);
+      }
+      if (childRight) {
+         rightKids.push_back(childRight);
+      }
+      rightKids.insert(rightKids.end(), n->kids.begin() + k + 1, n->kids.end());
+      left = branch(std::move(leftKids));
+      right = branch(std::move(rightKids));
+   }
+
+   static int heightOf(const ptr& t) {
+      int height = 0;
+      for (const node* n = t.get(); n && !n->kids.empty(); n = n->kids[0].get()) {
+         ++height;
+      }
+      return height;
+   }
+
+   // Removes single-child roots.
+   static void trim(ptr& root, int& height) {
+      while (root && height > 0 && root->kids.size() == 1) {
+         ptr child = root->kids[0];
+         root = child;
+         --height;
+      }
+      if (root && root->size == 0) {
+         root = ptr();
+         height = 0;
+      }
+   }
+
+   // The sequence hash of the elements under t. Children keep their own
+   // cached hashes, so after an edit only the new path is rehashed.
+   static size_t hash(const ptr& t) {
+      if (!t) {
+         return 0;
+      }
+      return t->hash.get([&t]() {
+         size_t result = 0;
+         for (const auto& elem : t->elems) {
+            result = result * seqHashBase + mixHash(hashOf(elem));
+         }
+         for (const auto& kid : t->kids) {
+            result = result * seqHashPower(kid->size) + hash(kid);
+         }
+         return result;
+      });
+   }
+
+   // Builds a dense tree from a range, bottom-up, in O(n).
+   template <typename IT>
+   static void build(IT begin, IT end, ptr& root, int& height) {
+      std::vector<ptr> level;
+      while (begin != end) {
+         std::vector<T> elems;
+         elems.reserve(rrbWidth);
+         for (; begin != end && elems.size() < rrbWidth; ++begin) {
+            elems.push_back(*begin);
+         }
+         level.push_back(leaf(std::move(elems)));
+      }
+      height = 0;
+      if (level.empty()) {
+         root = ptr();
+         return;
+      }
+      while (level.size() > 1) {
+         std::vector<ptr> parents;
+         for (size_t i = 0; i < level.size(); i += rrbWidth) {
+            parents.push_back(branch(std::vector<ptr>(level.begin() + i, level.begin() + std::min(level.size(), i + rrbWidth))));
+         }
+         level.swap(parents);
+         ++height;
+      }
+      root = level[0];
+   }
+};
+
+// Iterates over an RRB tree one leaf at a time.
+template <typename T>
+class rrbIterator {
+public:
+   typedef std::forward_iterator_tag iterator_category;
+   typedef T value_type;
+   typedef std::ptrdiff_t difference_type;
+   typedef const T* pointer;
+   typedef const T& reference;
+
+   rrbIterator() : leaf(nullptr), index(0) {}
+   explicit rrbIterator(const typename rrb<T>::node* root) : leaf(nullptr), index(0) {
+      if (root) {
+         descend(root);
+      }
+   }
+
+   reference operator*() const { return leaf->elems[index]; }
+   pointer operator->() const { return &leaf->elems[index]; }
+   rrbIterator& operator++() {
+      if (++index == leaf->elems.size()) {
+         nextLeaf();
+      }
+      return *this;
+   }
+   rrbIterator operator++(int) {
+      rrbIterator result(*this);
+      ++*this;
+      return result;
+   }
+   bool operator==(const rrbIterator& other) const { return leaf == other.leaf && index == other.index; }
+   bool operator!=(const rrbIterator& other) const { return !(*this == other); }
+
+   // If this and other both stand at the start of the same node, steps
+   // both past the largest such node and returns the number of elements
+   // skipped, else returns 0.
+   size_t skipShared(rrbIterator& other) {
+      if (leaf != other.leaf || index != 0 || other.index != 0) {
+         return 0;
+      }
+      size_t n = path.size();
+      size_t m = other.path.size();
+      size_t up = 0;
+      for (; up < n && up < m; ++up) {
+         const auto& a = path[n - 1 - up];
+         const auto& b = other.path[m - 1 - up];
+         if (a.first != b.first || a.second != 0 || b.second != 0) {
+            break;
+         }
+      }
+      size_t skipped = up == 0 ? leaf->size : path[n - up].first->size;
+      path.resize(n - up);
+      other.path.resize(m - up);
+      nextLeaf();
+      other.nextLeaf();
+      return skipped;
+   }
+
+private:
+   void nextLeaf() {
+      index = 0;
+      leaf = nullptr;
+      while (!path.empty()) {
+         auto& top = path.back();
+         if (++top.second < top.first->kids.size()) {
+            descend(top.first->kids[top.second].get());
+            return;
+         }
+         path.pop_back();
+      }
+   }
+
+   void descend(const typename rrb<T>::node* n) {
+      while (!n->kids.empty()) {
+         path.push_back(std::make_pair(n, (size_t) 0));
+         n = n->kids[0].get();
+      }
+      leaf = n;
+   }
+
+   std::vector<std::pair<const typename rrb<T>::node*, size_t>> path;
+   const typename rrb<T>::node* leaf;
+   size_t index;
+};
+
+} // namespace sanity_detail
+
+// __pvector<T>__.
+// A persistent vector backed by an RRB tree. Indexing and assoc take
+// O(log n); concat, subvec, splitAt and insertion at any index also take
+// O(log n) instead of copying, so large vectors can be split apart,
+// processed in parallel and joined again cheaply.
+template <typename T>
+class pvector {
+public:
+   typedef T value_type;
+   typedef sanity_detail::rrb<T> tree;
+   typedef sanity_detail::rrbIterator<T> const_iterator;
+   typedef const_iterator iterator;
+
+   pvector() : height(0) {}
+   pvector(std::initializer_list<T> elems) { tree::build(elems.begin(), elems.end(), root, height); }
+   template <typename IT>
+   pvector(IT begin, IT end) { tree::build(begin, end, root, height); }
+   explicit pvector(const typename tree::ptr& root) : root(root), height(tree::heightOf(root)) {}
+
+   size_t size() const { return tree::size(root); }
+   bool empty() const { return !root; }
+   const_iterator begin() const { return const_iterator(root.get()); }
+   const_iterator end() const { return const_iterator(); }
+   const typename tree::ptr& rootNode() const { return root; }
+
+   const T& operator[](size_t i) const { return tree::lookup(root.get(), i); }
+
+   const T& at(size_t i) const {
+      if (i >= size()) {
+         throw std::out_of_range("pvector index out of range");
+      }
+      return (*this)[i];
+   }
+
+   // Returns a pvector with the element at i replaced by val.
+   pvector assoc(size_t i, const T& val) const {
+      if (i >= size()) {
+         throw std::out_of_range("pvector index out of range");
+      }
+      return pvector(tree::update(root, i, val), height);
+   }
+
+   pvector concat(const pvector& other) const {
+      typename tree::ptr result;
+      int h;
+      tree::concat(root, height, other.root, other.height, result, h);
+      return pvector(result, h);
+   }
+
+   // Returns the first n elements and the rest.
+   std::pair<pvector, pvector> splitAt(size_t n) const {
+      if (!root) {
+         return std::make_pair(*this, *this);
+      }
+      typename tree::ptr left, right;
+      tree::split(root, std::min(n, size()), left, right);
+      return std::make_pair(pvector(left, height), pvector(right, height));
+   }
+
+   // Returns the elements from start up to, but not including, end.
+   pvector subvec(size_t start, size_t end) const {
+      return splitAt(end).first.splitAt(start).second;
+   }
+
+   pvector insert(size_t i, const T& val) const {
+      auto parts = splitAt(i);
+      return parts.first.pushBack(val).concat(parts.second);
+   }
+
+   pvector pushBack(const T& val) const { return concat(pvector(std::vector<T>(1, val))); }
+   pvector pushFront(const T& val) const { return pvector(std::vector<T>(1, val)).concat(*this); }
+
+   // Cached after the first call; O(log n) for a pvector derived from a hashed one.
+   size_t hash() const { return tree::hash(root); }
+
+   // Subtrees the two vectors share at the same position are skipped.
+   bool operator==(const pvector& other) const {
+      if (root == other.root) {
+         return true;
+      }
+      if (size() != other.size() || sanity_detail::knownUnequal(root->hash, other.root->hash)) {
+         return false;
+      }
+      for (const_iterator i = begin(), j = other.begin(), e = end(); i != e;) {
+         if (!i.skipShared(j)) {
+            if (!(*i == *j)) {
+               return false;
+            }
+            ++i;
+            ++j;
+         }
+      }
+      return true;
+   }
+   bool operator!=(const pvector& other) const { return !(*this == other); }
+
+private:
+   explicit pvector(const std::vector<T>& elems) { tree::build(elems.begin(), elems.end(), root, height); }
+   pvector(const typename tree::ptr& root, int height) : root(root), height(height) { tree::trim(this->root, this->height); }
+
+   typename tree::ptr root;
+   int height;
+};
+
+// __first(pvector)__.
+// Returns the first element of a pvector.
+template <typename T>
+T first(const pvector<T>& coll) {
+   if (coll.empty()) {
+      throw std::out_of_range("pvector is empty");
+   }
+   return coll[0];
+}
+
+// __last(pvector)__.
+// Returns the last element of a pvector.
+template <typename T>
+T last(const pvector<T>& coll) {
+   if (coll.empty()) {
+      throw std::out_of_range("pvector is empty");
+   }
+   return coll[coll.size() - 1];
+}
+
+// __rest(pvector)__.
+// Returns all but the first element of a pvector, in O(log n).
+template <typename T>
+pvector<T> rest(const pvector<T>& coll) {
+   return coll.splitAt(1).second;
+}
+
+// __butlast(pvector)__.
+// Returns all but the last element of a pvector, in O(log n).
+template <typename T>
+pvector<T> butlast(const pvector<T>& coll) {
+   return coll.splitAt(coll.empty() ? 0 : coll.size() - 1).first;
+}
+
+// __cons(pvector, item)__.
+// Returns a pvector with item added at the front, in O(log n).
+template <typename T>
+pvector<T> cons(const pvector<T>& coll, const T& item) {
+   return coll.pushFront(item);
+}
+
+// __conj(pvector, item)__.
+// Returns a pvector with item added at the back, in O(log n).
+template <typename T>
+pvector<T> conj(const pvector<T>& coll, const T& item) {
+   return coll.pushBack(item);
+}
+
+// __nth(pvector, index)__.
+// Returns the element at index in O(log n).
+template <typename T>
+T nth(const pvector<T>& coll, long index) {
+   return coll[index];
+}
+
+// __assoc(pvector, index, val)__.
+// Returns a pvector with the element at index replaced by val, in O(log n).
+template <typename T>
+pvector<T> assoc(const pvector<T>& coll, size_t index, const T& val) {
+   return coll.assoc(index, val);
+}
+
+// __concat(pvector1, pvector2)__.
+// Concatenates two pvectors in O(log n).
+template <typename T>
+pvector<T> concat(const pvector<T>& coll1, const pvector<T>& coll2) {
+   return coll1.concat(coll2);
+}
+
+// __take(pvector, n)__.
+// Returns the first n items of a pvector in O(log n).
+template <typename T>
+pvector<T> take(const pvector<T>& coll, long n) {
+   return coll.splitAt(std::max(0L, n)).first;
+}
+
+// __drop(pvector, n)__.
+// Returns a pvector with the first n items removed, in O(log n).
+template <typename T>
+pvector<T> drop(const pvector<T>& coll, long n) {
+   return coll.splitAt(std::max(0L, n)).second;
+}
+
+// __subvec(pvector, start, end)__.
+// Returns the items from start up to, but not including, end, in O(log n).
+template <typename T>
+pvector<T> subvec(const pvector<T>& coll, long start, long end) {
+   return coll.subvec(std::max(0L, start), std::max(0L, end));
+}
+
+// __insertAt(pvector, index, item)__.
+// Returns a pvector with item inserted before index, in O(log n).
+template <typename T>
+pvector<T> insertAt(const pvector<T>& coll, long index, const T& item) {
+   return coll.insert(std::max(0L, index), item);
+}
+
+// ## Persistent sets.
+
+namespace sanity_detail {
+
+inline unsigned popCount(uint32_t x) {
+   x = x - ((x >> 1) & 0x55555555u);
+   x = (x & 0x33333333u) + ((x >> 2) & 0x33333333u);
+   return (((x + (x >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24;
+}
+
+// A hash array mapped trie in CHAMP layout: each node has one bitmap for
+// the values stored inline and one for its children, indexed by 5 bits of
+// the hash per level. Once the hash bits run out, a node holds colliding
+// values in a plain list. A child holding a single value is always inlined
+// into its parent, so every set has exactly one shape.
+template <typename T, typename H>
+struct hamt {
+   struct node;
+   typedef std::shared_ptr<const node> ptr;
+
+   struct node {
+      node() : dataMap(0), nodeMap(0), size(0) {}
+      uint32_t dataMap;
+      uint32_t nodeMap;
+      std::vector<T> data;
+      std::vector<ptr> kids;
+      size_t size;
+      hashCache hash;
+   };
+
+   static const unsigned bits = 5;
+   static const unsigned hashBits = sizeof(size_t) * 8;
+
+   static size_t hashOf(const T& val) { return H()(val); }
+   static uint32_t bitFor(size_t hash, unsigned shift) { return 1u << ((hash >> shift) & 31); }
+   static unsigned index(uint32_t map, uint32_t bit) { return popCount(map & (bit - 1)); }
+   static size_t size(const ptr& t) { return t ? t->size : 0; }
+   static bool singleValue(const ptr& t) { return t->kids.empty() && t->data.size() == 1; }
+
+   static ptr make(uint32_t dataMap, uint32_t nodeMap, std::vector<T> data, std::vector<ptr> kids) {
+      if (data.empty() && kids.empty()) {
+         return ptr();
+      }
+      auto n = std::make_shared<node>();
+      n->dataMap = dataMap;
+      n->nodeMap = nodeMap;
+      n->size = data.size();
+      for (const auto& kid : kids) {
+         n->size += kid->size;
+      }
+      n->data = std::move(data);
+      n->kids = std::move(kids);
+      return n;
+   }
+
+   // A node at shift holding two distinct values.
+   static ptr pair(const T& a, size_t ha, const T& b, size_t hb, unsigned shift) {
+      if (shift >= hashBits) {
+         std::vector<T> data;
+         data.push_back(a);
+         data.push_back(b);
+         return make(0, 0, std::move(data), std::vector<ptr>());
+      }
+      uint32_t ba = bitFor(ha, shift);
+      uint32_t bb = bitFor(hb, shift);
+      if (ba == bb) {
+         return make(0, ba, std::vector<T>(), std::vector<ptr>(1, pair(a, ha, b, hb, shift + bits)));
+      }
+      std::vector<T> data;
+      data.push_back(ba < bb ? a : b);
+      data.push_back(ba < bb ? b : a);
+      return make(ba | bb, 0, std::move(data), std::vector<ptr>());
+   }
+
+   static bool contains(const ptr& root, const T& val, size_t hash, unsigned shift = 0) {
+      const node* t = root.get();
+      for (; t; shift += bits) {
+         if (shift >= hashBits) {
+            return std::find(t->data.begin(), t->data.end(), val) != t->data.end();
+         }
+         uint32_t bit = bitFor(hash, shift);
+         if (t->dataMap & bit) {
+            return t->data[index(t->dataMap, bit)] == val;
+         }
+         if (!(t->nodeMap & bit)) {
+            return false;
+         }
+         t = t->kids[index(t->nodeMap, bit)].get();
+      }
+      return false;
+   }
+
+   // Returns t itself if val is already present.
+   static ptr insert(const ptr& t, const T& val, size_t hash, unsigned shift) {
+      if (!t) {
+         return make(shift >= hashBits ? 0 : bitFor(hash, shift), 0, std::vector<T>(1, val), std::vector<ptr>());
+      }
+      if (shift >= hashBits) {
+         if (std::find(t->data.begin(), t->data.end(), val) != t->data.end()) {
+            return t;
+         }
+         std::vector<T> data(t->data);
+         data.push_back(val);
+         return make(0, 0, std::move(data), t->kids);
+      }
+      uint32_t bit = bitFor(hash, shift);
+      if (t->dataMap & bit) {
+         unsigned i = index(t->dataMap, bit);
+         const T& old = t->data[i];
+         if (old == val) {
+            return t;
+         }
+         std::vector<ptr> kids(t->kids);
+         kids.insert(kids.begin() + index(t->nodeMap | bit, bit), pair(old, hashOf(old), val, hash, shift + bits));
+         std::vector<T> data(t->data);
+         data.erase(data.begin() + i);
+         return make(t->dataMap ^ bit, t->nodeMap | bit, std::move(data), std::move(kids));
+      }
+      if (t->nodeMap & bit) {
+         unsigned k = index(t->nodeMap, bit);
+         ptr kid = insert(t->kids[k], val, hash, shift + bits);
+         if (kid == t->kids[k]) {
+            return t;
+         }
+         std::vector<ptr> kids(t->kids);
+         kids[k] = kid;
+         return make(t->dataMap, t->nodeMap, t->data, std::move(kids));
+      }
+      std::vector<T> data(t->data);
+      data.insert(data.begin() + index(t->dataMap, bit), val);
+      return make(t->dataMap | bit, t->nodeMap, std::move(data), t->kids);
+   }
+
+   // Returns t itself if val is absent.
+   static ptr erase(const ptr& t, const T& val, size_t hash, unsigned shift) {
+      if (!t) {
+         return t;
+      }
+      if (shift >= hashBits) {
+         auto iter = std::find(t->data.begin(), t->data.end(), val);
+         if (iter == t->data.end()) {
+            return t;
+         }
+         std::vector<T> data(t->data.begin(), iter);
+         data.insert(data.end(), iter + 1, t->data.end());
+         return make(0, 0, std::move(data), t->kids);
+      }
+      uint32_t bit = bitFor(hash, shift);
+      if (t->dataMap & bit) {
+         unsigned i = index(t->dataMap, bit);
+         if (!(t->data[i] == val)) {
+            return t;
+         }
+         std::vector<T> data(t->data);
+         data.erase(data.begin() + i);
+         return make(t->dataMap ^ bit, t->nodeMap, std::move(data), t->kids);
+      }
+      if (!(t->nodeMap & bit)) {
+         return t;
+      }
+      unsigned k = index(t->nodeMap, bit);
+      ptr kid = erase(t->kids[k], val, hash, shift + bits);
+      if (kid == t->kids[k]) {
+         return t;
+      }
+      builder out;
+      for (unsigned f = 0; f < 32; ++f) {
+         uint32_t b = 1u << f;
+         if (b == bit) {
+            out.addKid(b, kid);
+         } else {
+            out.copy(t.get(), b);
+         }
+      }
+      return out.finish();
+   }
+
+   // Assembles a node slot by slot, in bit order.
+   struct builder {
+      builder() : dataMap(0), nodeMap(0) {}
+      void addVal(uint32_t bit, const T& val) {
+         dataMap |= bit;
+         data.push_back(val);
+      }
+      void addKid(uint32_t bit, const ptr& kid) {
+         if (!kid) {
+            return;
+         }
+         if (singleValue(kid)) {
+            addVal(bit, kid->data[0]);
+         } else {
+            nodeMap |= bit;
+            kids.push_back(kid);
+         }
+      }
+      void copy(const node* t, uint32_t bit) {
+         if (t->dataMap & bit) {
+            addVal(bit, t->data[index(t->dataMap, bit)]);
+         } else if (t->nodeMap & bit) {
+            addKid(bit, t->kids[index(t->nodeMap, bit)]);
+         }
+      }
+      ptr finish() { return make(dataMap, nodeMap, std::move(data), std::move(kids)); }
+      uint32_t dataMap;
+      uint32_t nodeMap;
+      std::vector<T> data;
+      std::vector<ptr> kids;
+   };
+
+   static const T* valAt(const node* t, uint32_t bit) {
+      return (t->dataMap & bit) ? &t->data[index(t->dataMap, bit)] : nullptr;
+   }
+   static const ptr* kidAt(const node* t, uint32_t bit) {
+      return (t->nodeMap & bit) ? &t->kids[index(t->nodeMap, bit)] : nullptr;
+   }
+
+   // Collision nodes: keep the values of a for which keep(val) is true,
+   // then add extra.
+   template <typename F>
+   static ptr filterCollisions(const ptr& a, const F& keep, const std::vector<T>& extra) {
+      std::vector<T> data;
+      for (const auto& val : a->data) {
+         if (keep(val)) {
+            data.push_back(val);
+         }
+      }
+      if (data.size() == a->data.size() && extra.empty()) {
+         return a;
+      }
+      data.insert(data.end(), extra.begin(), extra.end());
+      return make(0, 0, std::move(data), std::vector<ptr>());
+   }
+
+   // An order-independent sum over the values, cached in every node.
+   static size_t hash(const ptr& t) {
+      if (!t) {
+         return 0;
+      }
+      return t->hash.get([&t]() {
+         size_t result = 0;
+         for (const auto& val : t->data) {
+            result += mixHash(hashOf(val));
+         }
+         for (const auto& kid : t->kids) {
+            result += hash(kid);
+         }
+         return result;
+      });
+   }
+
+   // Equal sets have the same shape, so tries compare node by node and
+   // shared nodes are equal without looking inside.
+   static bool equal(const ptr& a, const ptr& b, unsigned shift) {
+      if (a == b) {
+         return true;
+      }
+      if (!a || !b || a->size != b->size || a->dataMap != b->dataMap || a->nodeMap != b->nodeMap ||
+          knownUnequal(a->hash, b->hash)) {
+         return false;
+      }
+      if (shift >= hashBits) {
+         for (const auto& val : a->data) {
+            if (std::find(b->data.begin(), b->data.end(), val) == b->data.end()) {
+               return false;
+            }
+         }
+         return true;
+      }
+      if (!std::equal(a->data.begin(), a->data.end(), b->data.begin())) {
+         return false;
+      }
+      for (size_t k = 0; k < a->kids.size(); ++k) {
+         if (!equal(a->kids[k], b->kids[k], shift + bits)) {
+            return false;
+         }
+      }
+      return true;
+   }
+
+   // Each set operation walks both tries together and returns subtrees of
+   // a unchanged, by pointer, wherever the result matches them.
+   static ptr unite(const ptr& a, const ptr& b, unsigned shift) {
+      if (a == b || !b) {
+         return a;
+      }
+      if (!a) {
+         return b;
+      }
+      if (shift >= hashBits) {
+         std::vector<T> extra;
+         for (const auto& val : b->data) {
+            if (std::find(a->data.begin(), a->data.end(), val) == a->data.end()) {
+               extra.push_back(val);
+            }
+         }
+         return filterCollisions(a, [](const T&) { return true; }, extra);
+      }
+      builder out;
+      bool changed = false;
+      for (unsigned f = 0; f < 32; ++f) {
+         uint32_t bit = 1u << f;
+         const T* va = valAt(a.get(), bit);
+         const ptr* ka = kidAt(a.get(), bit);
+         const T* vb = valAt(b.get(), bit);
+         const ptr* kb = kidAt(b.get(), bit);
+         if (!vb && !kb) {
+            out.copy(a.get(), bit);
+         } else if (!va && !ka) {
+            out.copy(b.get(), bit);
+            changed = true;
+         } else if (va && vb) {
+            if (*va == *vb) {
+               out.addVal(bit, *va);
+            } else {
+               out.addKid(bit, pair(*va, hashOf(*va), *vb, hashOf(*vb), shift + bits));
+               changed = true;
+            }
+         } else if (va) {
+            out.addKid(bit, insert(*kb, *va, hashOf(*va), shift + bits));
+            changed = true;
+         } else {
+            ptr kid = vb ? insert(*ka, *vb, hashOf(*vb), shift + bits) : unite(*ka, *kb, shift + bits);
+            out.addKid(bit, kid);
+            changed = changed || kid != *ka;
+         }
+      }
+      return changed ? out.finish() : a;
+   }
+
+   static ptr intersect(const ptr& a, const ptr& b, unsigned shift) {
+      if (a == b || !a || !b) {
+         return a == b ? a : ptr();
+      }
+      if (shift >= hashBits) {
+         const node* other = b.get();
+         return filterCollisions(a, [other](const T& val) {
+            return std::find(other->data.begin(), other->data.end(), val) != other->data.end();
+         }, std::vector<T>());
+      }
+      builder out;
+      bool changed = false;
+      for (unsigned f = 0; f < 32; ++f) {
+         uint32_t bit = 1u << f;
+         const T* va = valAt(a.get(), bit);
+         const ptr* ka = kidAt(a.get(), bit);
+         const T* vb = valAt(b.get(), bit);
+         const ptr* kb = kidAt(b.get(), bit);
+         if (!va && !ka) {
+            continue;
+         }
+         if (!vb && !kb) {
+            changed = true;
+         } else if (va) {
+            bool keep = vb ? *va == *vb : contains(*kb, *va, hashOf(*va), shift + bits);
+            if (keep) {
+               out.addVal(bit, *va);
+            } else {
+               changed = true;
+            }
+         } else if (vb) {
+            if (contains(*ka, *vb, hashOf(*vb), shift + bits)) {
+               out.addVal(bit, *vb);
+            }
+            changed = true;
+         } else {
+            ptr kid = intersect(*ka, *kb, shift + bits);
+            out.addKid(bit, kid);
+            changed = changed || kid != *ka;
+         }
+      }
+      return changed ? out.finish() : a;
+   }
+
+   static ptr subtract(const ptr& a, const ptr& b, unsigned shift) {
+      if (a == b || !a) {
+         return ptr();
+      }
+      if (!b) {
+         return a;
+      }
+      if (shift >= hashBits) {
+         const node* other = b.get();
+         return filterCollisions(a, [other](const T& val) {
+            return std::find(other->data.begin(), other->data.end(), val) == other->data.end();
+         }, std::vector<T>());
+      }
+      builder out;
+      bool changed = false;
+      for (unsigned f = 0; f < 32; ++f) {
+         uint32_t bit = 1u << f;
+         const T* va = valAt(a.get(), bit);
+         const ptr* ka = kidAt(a.get(), bit);
+         const T* vb = valAt(b.get(), bit);
+         const ptr* kb = kidAt(b.get(), bit);
+         if (!vb && !kb) {
+            out.copy(a.get(), bit);
+         } else if (va) {
+            bool drop = vb ? *va == *vb : contains(*kb, *va, hashOf(*va), shift + bits);
+            if (drop) {
+               changed = true;
+            } else {
+               out.addVal(bit, *va);
+            }
+         } else if (ka) {
+            ptr kid = vb ? erase(*ka, *vb, hashOf(*vb), shift + bits) : subtract(*ka, *kb, shift + bits);
+            out.addKid(bit, kid);
+            changed = changed || kid != *ka;
+         }
+      }
+      return changed ? out.finish() : a;
+   }
+};
+
+// Visits the values of a hamt depth first.
+template <typename T, typename H>
+class hamtIterator {
+public:
+   typedef std::forward_iterator_tag iterator_category;
+   typedef T value_type;
+   typedef std::ptrdiff_t difference_type;
+   typedef const T* pointer;
+   typedef const T& reference;
+   typedef typename hamt<T, H>::node node;
+
+   hamtIterator() : current(nullptr), index(0) {}
+   explicit hamtIterator(const node* root) : current(nullptr), index(0) {
+      if (root) {
+         pending.push_back(root);
+      }
+      settle();
+   }
+
+   reference operator*() const { return current->data[index]; }
+   pointer operator->() const { return &current->data[index]; }
+   hamtIterator& operator++() {
+      ++index;
+      settle();
+      return *this;
+   }
+   hamtIterator operator++(int) {
+      hamtIterator result(*this);
+      ++*this;
+      return result;
+   }
+   bool operator==(const hamtIterator& other) const { return current == other.current && index == other.index; }
+   bool operator!=(const hamtIterator& other) const { return !(*this == other); }
+
+private:
+   void settle() {
+      while (!current || index >= current->data.size()) {
+         index = 0;
+         if (pending.empty()) {
+            current = nullptr;
+            return;
+         }
+         current = pending.back();
+         pending.pop_back();
+         for (const auto& kid : current->kids) {
+            pending.push_back(kid.get());
+         }
+      }
+   }
+
+   std::vector<const node*> pending;
+   const node* current;
+   size_t index;
+};
+
+// Join-based set algorithms on an avl tree of values. Like the hamt
+// versions, they return subtrees of a unchanged wherever possible.
+template <typename T>
+struct avlSet {
+   typedef avl<T, setKeyOf> tree;
+   typedef typename tree::ptr ptr;
+   typedef typename tree::node node;
+
+   static ptr unite(const ptr& a, const ptr& b) {
+      if (a == b || !b) {
+         return a;
+      }
+      if (!a) {
+         return b;
+      }
+      ptr less, greater;
+      const node* found = nullptr;
+      tree::split(b, a->entry, less, found, greater);
+      ptr left = unite(a->left, less);
+      ptr right = unite(a->right, greater);
+      return left == a->left && right == a->right ? a : tree::join(left, a->entry, right);
+   }
+
+   static ptr intersect(const ptr& a, const ptr& b) {
+      if (a == b || !a || !b) {
+         return a == b ? a : ptr();
+      }
+      ptr less, greater;
+      const node* found = nullptr;
+      tree::split(b, a->entry, less, found, greater);
+      ptr left = intersect(a->left, less);
+      ptr right = intersect(a->right, greater);
+      if (!found) {
+         return tree::join2(left, right);
+      }
+      return left == a->left && right == a->right ? a : tree::join(left, a->entry, right);
+   }
+
+   static ptr subtract(const ptr& a, const ptr& b) {
+      if (a == b || !a) {
+         return ptr();
+      }
+      if (!b) {
+         return a;
+      }
+      ptr less, greater;
+      const node* found = nullptr;
+      tree::split(b, a->entry, less, found, greater);
+      ptr left = subtract(a->left, less);
+      ptr right = subtract(a->right, greater);
+      if (found) {
+         return tree::join2(left, right);
+      }
+      return left == a->left && right == a->right ? a : tree::join(left, a->entry, right);
+   }
+};
+
+} // namespace sanity_detail
+
+// __phashset<T, H>__.
+// A persistent hash set (a HAMT). conj, disj and contains take O(log32 n).
+template <typename T, typename H = std::hash<T>>
+class phashset {
+public:
+   typedef T value_type;
+   typedef T key_type;
+   typedef sanity_detail::hamt<T, H> tree;
+   typedef typename tree::ptr nodePtr;
+   typedef sanity_detail::hamtIterator<T, H> const_iterator;
+   typedef const_iterator iterator;
+
+   phashset() {}
+   explicit phashset(const nodePtr& root) : root(root) {}
+   phashset(std::initializer_list<T> vals) {
+      for (auto& val : vals) {
+         root = tree::insert(root, val, tree::hashOf(val), 0);
+      }
+   }
+   template <typename IT>
+   phashset(IT begin, IT end) {
+      for (; begin != end; ++begin) {
+         root = tree::insert(root, *begin, tree::hashOf(*begin), 0);
+      }
+   }
+
+   size_t size() const { return tree::size(root); }
+   bool empty() const { return !root; }
+   const_iterator begin() const { return const_iterator(root.get()); }
+   const_iterator end() const { return const_iterator(); }
+   const nodePtr& rootNode() const { return root; }
+
+   bool contains(const T& val) const { return tree::contains(root, val, tree::hashOf(val)); }
+   phashset conj(const T& val) const { return phashset(tree::insert(root, val, tree::hashOf(val), 0)); }
+   phashset disj(const T& val) const { return phashset(tree::erase(root, val, tree::hashOf(val), 0)); }
+
+   // Cached after the first call; O(log n) for a phashset derived from a hashed one.
+   size_t hash() const { return tree::hash(root); }
+
+   bool operator==(const phashset& other) const { return tree::equal(root, other.root, 0); }
+   bool operator!=(const phashset& other) const { return !(*this == other); }
+
+private:
+   nodePtr root;
+};
+
+// __psortedset<T>__.
+// A persistent sorted set. conj, disj and contains take O(log n).
+template <typename T>
+class psortedset {
+public:
+   typedef T value_type;
+   typedef T key_type;
+   typedef sanity_detail::avl<T, sanity_detail::setKeyOf> tree;
+   typedef typename tree::ptr nodePtr;
+   typedef sanity_detail::avlIterator<T> const_iterator;
+   typedef const_iterator iterator;
+
+   psortedset() {}
+   explicit psortedset(const nodePtr& root) : root(root) {}
+   psortedset(std::initializer_list<T> vals) {
+      for (auto& val : vals) {
+         root = tree::insert(root, val);
+      }
+   }
+   template <typename IT>
+   psortedset(IT begin, IT end) {
+      for (; begin != end; ++begin) {
+         root = tree::insert(root, *begin);
+      }
+   }
+
+   size_t size() const { return tree::size(root); }
+   bool empty() const { return !root; }
+   const_iterator begin() const { return const_iterator(root.get()); }
+   const_iterator end() const { return const_iterator(); }
+   const nodePtr& rootNode() const { return root; }
+
+   bool contains(const T& val) const { return tree::find(root, val) != nullptr; }
+   psortedset conj(const T& val) const { return contains(val) ? *this : psortedset(tree::insert(root, val)); }
+   psortedset disj(const T& val) const { return psortedset(tree::erase(root, val)); }
+
+   size_t hash() const { return tree::hash(root); }
+
+   bool operator==(const psortedset& other) const { return sanity_detail::avlEqual(root, other.root); }
+   bool operator!=(const psortedset& other) const { return !(*this == other); }
+
+private:
+   nodePtr root;
+};
+
+// __contains(set, value)__.
+// Returns true if a persistent set contains value, without a linear scan.
+template <typename T, typename H>
+bool contains(const phashset<T, H>& set, const T& value) {
+   return set.contains(value);
+}
+
+template <typename T>
+bool contains(const psortedset<T>& set, const T& value) {
+   return set.contains(value);
+}
+
+// __conj(set, value)__.
+// Adds value to a persistent set.
+template <typename T, typename H>
+phashset<T, H> conj(const phashset<T, H>& set, const T& value) {
+   return set.conj(value);
+}
+
+template <typename T>
+psortedset<T> conj(const psortedset<T>& set, const T& value) {
+   return set.conj(value);
+}
+
+// __disj(set, value)__.
+// Removes value from a persistent set.
+template <typename T, typename H>
+phashset<T, H> disj(const phashset<T, H>& set, const T& value) {
+   return set.disj(value);
+}
+
+template <typename T>
+psortedset<T> disj(const psortedset<T>& set, const T& value) {
+   return set.disj(value);
+}
+
+// __setUnion(set1, set2)__.
+// Returns the values in either set. (union is a C++ keyword.) Subtrees the
+// two sets share are skipped, so combining two versions of one set costs
+// time proportional to how far they have diverged.
+template <typename T, typename H>
+phashset<T, H> setUnion(const phashset<T, H>& set1, const phashset<T, H>& set2) {
+   return phashset<T, H>(phashset<T, H>::tree::unite(set1.rootNode(), set2.rootNode(), 0));
+}
+
+template <typename T>
+psortedset<T> setUnion(const psortedset<T>& set1, const psortedset<T>& set2) {
+   return psortedset<T>(sanity_detail::avlSet<T>::unite(set1.rootNode(), set2.rootNode()));
+}
+
+// __intersection(set1, set2)__.
+// Returns the values in both sets, skipping shared subtrees.
+template <typename T, typename H>
+phashset<T, H> intersection(const phashset<T, H>& set1, const phashset<T, H>& set2) {
+   return phashset<T, H>(phashset<T, H>::tree::intersect(set1.rootNode(), set2.rootNode(), 0));
+}
+
+template <typename T>
+psortedset<T> intersection(const psortedset<T>& set1, const psortedset<T>& set2) {
+   return psortedset<T>(sanity_detail::avlSet<T>::intersect(set1.rootNode(), set2.rootNode()));
+}
+
+// __difference(set1, set2)__.
+// Returns the values in set1 that are not in set2, skipping shared subtrees.
+template <typename T, typename H>
+phashset<T, H> difference(const phashset<T, H>& set1, const phashset<T, H>& set2) {
+   return phashset<T, H>(phashset<T, H>::tree::subtract(set1.rootNode(), set2.rootNode(), 0));
+}
+
+template <typename T>
+psortedset<T> difference(const psortedset<T>& set1, const psortedset<T>& set2) {
+   return psortedset<T>(sanity_detail::avlSet<T>::subtract(set1.rootNode(), set2.rootNode()));
+}
+
+namespace std {
+
+// Persistent collections hash by value, caching the result in their
+// nodes, so they are cheap to use as map or memoize keys.
+template <typename K, typename V>
+struct hash<pmap<K, V>> {
+   size_t operator()(const pmap<K, V>& coll) const { return coll.hash(); }
+};
+
+template <typename T>
+struct hash<pdeque<T>> {
+   size_t operator()(const pdeque<T>& coll) const { return coll.hash(); }
+};
+
+template <typename T>
+struct hash<pvector<T>> {
+   size_t operator()(const pvector<T>& coll) const { return coll.hash(); }
+};
+
+template <typename T, typename H>
+struct hash<phashset<T, H>> {
+   size_t operator()(const phashset<T, H>& coll) const { return coll.hash(); }
+};
+
+template <typename T>
+struct hash<psortedset<T>> {
+   size_t operator()(const psortedset<T>& coll) const { return coll.hash(); }
+};
+
+} // namespace std
+
+// ## Persistent priority queues.
+
+namespace sanity_detail {
+
+// A leftist heap: every node's left child has a right spine at least as
+// long as its right child's, so the right spine has O(log n) nodes and
+// merging walks only the right spines of the two heaps.
+template <typename T, typename Compare>
+struct leftist {
+   struct node;
+   typedef std::shared_ptr<const node> ptr;
+
+   struct node {
+      node(const T& val, const ptr& a, const ptr& b)
+         : val(val), size(1 + sizeOf(a) + sizeOf(b)) {
+         if (rankOf(a) >= rankOf(b)) {
+            left = a;
+            right = b;
+         } else {
+            left = b;
+            right = a;
+         }
+         rank = 1 + rankOf(right);
+      }
+      // The left spine can be O(n) long, so tear down uniquely owned
+      // subtrees with an explicit stack rather than by recursion. Nodes
+      // are allocated non-const, so casting const away here is defined.
+      ~node() {
+         std::vector<ptr> pending;
+         release(left, pending);
+         release(right, pending);
+         while (!pending.empty()) {
+            ptr t = std::move(pending.back());
+            pending.pop_back();
+            node& n = const_cast<node&>(*t);
+            release(n.left, pending);
+            release(n.right, pending);
+         }
+      }
+      static void release(ptr& kid, std::vector<ptr>& pending) {
+         if (kid && kid.use_count() == 1) {
+            pending.push_back(std::move(kid));
+         }
+      }
+      T val;
+      ptr left;
+      ptr right;
+      int rank;
+      size_t size;
+   };
+
+   static int rankOf(const ptr& t) { return t ? t->rank : 0; }
+   static size_t sizeOf(const ptr& t) { return t ? t->size : 0; }
+
+   static ptr single(const T& val) { return std::make_shared<node>(val, ptr(), ptr()); }
+
+   static ptr merge(const ptr& a, const ptr& b, const Compare& cmp) {
+      if (!a) {
+         return b;
+      }
+      if (!b) {
+         return a;
+      }
+      if (cmp(b->val, a->val)) {
+         return std::make_shared<node>(b->val, b->left, merge(a, b->right, cmp));
+      }
+      return std::make_shared<node>(a->val, a->left, merge(a->right, b, cmp));
+   }
+
+   // Builds a heap from a range in O(n) by merging heaps pairwise.
+   template <typename IT>
+   static ptr build(IT begin, IT end, const Compare& cmp) {
+      std::deque<ptr> heaps;
+      for (; begin != end; ++begin) {
+         heaps.push_back(single(*begin));
+      }
+      while (heaps.size() > 1) {
+         ptr a = heaps.front();
+         heaps.pop_front();
+         ptr b = heaps.front();
+         heaps.pop_front();
+         heaps.push_back(merge(a, b, cmp));
+      }
+      return heaps.empty() ? ptr() : heaps.front();
+   }
+};
+
+} // namespace sanity_detail
+
+// __pheap<T, Compare>__.
+// A persistent priority queue. peek is O(1); push, pop and meld are
+// O(log n). With the default std::less, peek returns the smallest item.
+template <typename T, typename Compare = std::less<T>>
+class pheap {
+public:
+   typedef T value_type;
+   typedef sanity_detail::leftist<T, Compare> tree;
+   typedef typename tree::ptr nodePtr;
+
+   explicit pheap(const Compare& cmp = Compare()) : cmp(cmp) {}
+   pheap(std::initializer_list<T> vals, const Compare& cmp = Compare())
+      : root(tree::build(vals.begin(), vals.end(), cmp)), cmp(cmp) {}
+   template <typename IT>
+   pheap(IT begin, IT end, const Compare& cmp = Compare())
+      : root(tree::build(begin, end, cmp)), cmp(cmp) {}
+
+   size_t size() const { return tree::sizeOf(root); }
+   bool empty() const { return !root; }
+   const nodePtr& rootNode() const { return root; }
+
+   const T& peek() const {
+      if (!root) {
+         throw std::out_of_range("pheap is empty");
+      }
+      return root->val;
+   }
+
+   pheap push(const T& val) const { return pheap(tree::merge(root, tree::single(val), cmp), cmp); }
+
+   pheap pop() const {
+      if (!root) {
+         throw std::out_of_range("pheap is empty");
+      }
+      return pheap(tree::merge(root->left, root->right, cmp), cmp);
+   }
+
+   pheap meld(const pheap& other) const { return pheap(tree::merge(root, other.root, cmp), cmp); }
+
+private:
+   pheap(const nodePtr& root, const Compare& cmp) : root(root), cmp(cmp) {}
+
+   nodePtr root;
+   Compare cmp;
+};
+
+// __first(pheap)__.
+// Returns the highest priority item of a pheap in O(1).
+template <typename T, typename Compare>
+T first(const pheap<T, Compare>& heap) {
+   return heap.peek();
+}
+
+// __rest(pheap)__.
+// Returns a pheap without its highest priority item, in O(log n).
+template <typename T, typename Compare>
+pheap<T, Compare> rest(const pheap<T, Compare>& heap) {
+   return heap.empty() ? heap : heap.pop();
+}
+
+// __conj(pheap, item)__.
+// Adds item to a pheap in O(log n).
+template <typename T, typename Compare>
+pheap<T, Compare> conj(const pheap<T, Compare>& heap, const T& item) {
+   return heap.push(item);
+}
+
+// __meld(pheap1, pheap2)__.
+// Merges two pheaps in O(log n).
+template <typename T, typename Compare>
+pheap<T, Compare> meld(const pheap<T, Compare>& heap1, const pheap<T, Compare>& heap2) {
+   return heap1.meld(heap2);
+}
+
+// ## Structural diff.
+
+// __mapDiff<K, V>__.
+// The entries that differ between two versions of a map: added holds the
+// entries only in the new version, removed those only in the old one and
+// changed the keys in both with their old and new vals. All three are in
+// key order.
+template <typename K, typename V>
+struct mapDiff {
+   std::vector<std::pair<K, V>> added;
+   std::vector<std::pair<K, V>> removed;
+   std::vector<std::pair<K, std::pair<V, V>>> changed;
+
+   bool empty() const { return added.empty() && removed.empty() && changed.empty(); }
+};
+
+namespace sanity_detail {
+
+// Merges two key-ordered entry sequences into a diff. skip(i, j) may
+// step both iterators past entries they share and return true.
+template <typename K, typename V, typename IT, typename SKIP>
+mapDiff<K, V> mergeDiff(IT i, IT iEnd, IT j, IT jEnd, const SKIP& skip) {
+   mapDiff<K, V> result;
+   while (i != iEnd && j != jEnd) {
+      if (skip(i, j)) {
+         continue;
+      }
+      if (i->first < j->first) {
+         result.removed.push_back(*i);
+         ++i;
+      } else if (j->first < i->first) {
+         result.added.push_back(*j);
+         ++j;
+      } else {
+         if (!(i->second == j->second)) {
+            result.changed.push_back(std::make_pair(i->first, std::make_pair(i->second, j->second)));
+         }
+         ++i;
+         ++j;
+      }
+   }
+   result.removed.insert(result.removed.end(), i, iEnd);
+   result.added.insert(result.added.end(), j, jEnd);
+   return result;
+}
+
+} // namespace sanity_detail
+
+// __diff(map1, map2)__.
+// Returns what changed from map1 to map2, in one linear merge of the two maps.
+template <typename K, typename V>
+mapDiff<K, V> diff(const std::map<K, V>& map1, const std::map<K, V>& map2) {
+   typedef typename std::map<K, V>::const_iterator IT;
+   return sanity_detail::mergeDiff<K, V>(map1.begin(), map1.end(), map2.begin(), map2.end(),
+                                         [](IT&, IT&) { return false; });
+}
+
+// __diff(pmap1, pmap2)__.
+// Returns what changed from pmap1 to pmap2. Subtrees the two versions
+// share are skipped by pointer, so diffing a pmap against one derived from
+// it by k updates costs O(k log n), not O(n).
+template <typename K, typename V>
+mapDiff<K, V> diff(const pmap<K, V>& map1, const pmap<K, V>& map2) {
+   typedef typename pmap<K, V>::const_iterator IT;
+   if (map1.rootNode() == map2.rootNode()) {
+      return mapDiff<K, V>();
+   }
+   return sanity_detail::mergeDiff<K, V>(map1.begin(), map1.end(), map2.begin(), map2.end(), [](IT& i, IT& j) {
+      if (i.node() != j.node()) {
+         return false;
+      }
+      i.skipRight();
+      j.skipRight();
+      return true;
+   });
+}
+
+// __diff(pvector1, pvector2)__.
+// Returns what changed from pvector1 to pvector2, keyed by index: changed
+// holds indices in both whose elements differ, and added or removed the
+// tail by which one is longer. Subtrees shared at the same position are
+// skipped by pointer. An insertion shifts every later index, so use
+// diff on a pmap for keyed data.
+template <typename T>
+mapDiff<size_t, T> diff(const pvector<T>& coll1, const pvector<T>& coll2) {
+   mapDiff<size_t, T> result;
+   if (coll1.rootNode() == coll2.rootNode()) {
+      return result;
+   }
+   size_t n = std::min(coll1.size(), coll2.size());
+   auto i = coll1.begin();
+   auto j = coll2.begin();
+   for (size_t index = 0; index < n;) {
+      size_t skipped = i.skipShared(j);
+      if (skipped > 0) {
+         index += skipped;
+         continue;
+      }
+      if (!(*i == *j)) {
+         result.changed.push_back(std::make_pair(index, std::make_pair(*i, *j)));
+      }
+      ++i;
+      ++j;
+      ++index;
+   }
+   for (size_t index = n; index < coll1.size(); ++index, ++i) {
+      result.removed.push_back(std::make_pair(index, *i));
+   }
+   for (size_t index = n; index < coll2.size(); ++index, ++j) {
+      result.added.push_back(std::make_pair(index, *j));
+   }
+   return result;
+}
+
+// ## Incremental views.
+
+// __pmapView<K, V, R>__.
+// A pmap<K, R> derived entry by entry from a source pmap<K, V>, kept up to
+// date incrementally. derive(key, val, out) sets out and returns true to
+// keep the entry. update(newSource) diffs the new source against the last
+// one and re-derives only the entries that changed, so its cost follows
+// the size of the change. The derived pmap shares structure between
+// versions, so views can be stacked on views.
+template <typename K, typename V, typename R>
+class pmapView {
+public:
+   typedef std::function<bool(const K&, const V&, R&)> derivation;
+
+   pmapView(const pmap<K, V>& source, const derivation& derive) : src(source), derive(derive) {
+      std::vector<std::pair<K, R>> entries;
+      entries.reserve(source.size());
+      R out;
+      for (const auto& kv : source) {
+         if (derive(kv.first, kv.second, out)) {
+            entries.push_back(std::make_pair(kv.first, out));
+         }
+      }
+      auto iter = entries.cbegin();
+      result = pmap<K, R>(pmap<K, R>::tree::fromSorted(iter, entries.size()));
+   }
+
+   const pmap<K, R>& value() const { return result; }
+   const pmap<K, V>& source() const { return src; }
+
+   const pmap<K, R>& update(const pmap<K, V>& newSource) {
+      mapDiff<K, V> changes = diff(src, newSource);
+      for (const auto& kv : changes.removed) {
+         result = result.dissoc(kv.first);
+      }
+      for (const auto& kv : changes.added) {
+         apply(kv.first, kv.second);
+      }
+      for (const auto& kv : changes.changed) {
+         apply(kv.first, kv.second.second);
+      }
+      src = newSource;
+      return result;
+   }
+
+private:
+   void apply(const K& key, const V& val) {
+      R out;
+      result = derive(key, val, out) ? result.assoc(key, out) : result.dissoc(key);
+   }
+
+   pmap<K, V> src;
+   pmap<K, R> result;
+   derivation derive;
+};
+
+// __mapView(source, func)__.
+// An incremental map(source, func) over the vals of a pmap.
+template <typename K, typename V, typename F>
+auto mapView(const pmap<K, V>& source, const F& func) -> pmapView<K, V, decltype(func(std::declval<V>()))> {
+   typedef decltype(func(std::declval<V>())) R;
+   return pmapView<K, V, R>(source, [func](const K&, const V& val, R& out) {
+      out = func(val);
+      return true;
+   });
+}
+
+// __filterView(source, predicate)__.
+// An incremental filter(source, predicate) over the vals of a pmap.
+template <typename K, typename V, typename F>
+pmapView<K, V, V> filterView(const pmap<K, V>& source, const F& predicate) {
+   return pmapView<K, V, V>(source, [predicate](const K&, const V& val, V& out) {
+      if (!predicate(val)) {
+         return false;
+      }
+      out = val;
+      return true;
+   });
+}
+
+// __mapFilterView(source, func, predicate)__.
+// An incremental filter(map(source, func), predicate) over the vals of a pmap.
+template <typename K, typename V, typename F, typename P>
+auto mapFilterView(const pmap<K, V>& source, const F& func, const P& predicate)
+   -> pmapView<K, V, decltype(func(std::declval<V>()))> {
+   typedef decltype(func(std::declval<V>())) R;
+   return pmapView<K, V, R>(source, [func, predicate](const K&, const V& val, R& out) {
+      out = func(val);
+      return predicate(out);
+   });
+}
+
+// __groupedView<K, V, G>__.
+// Groups the entries of a source pmap<K, V> by group(val) into a
+// pmap<G, pmap<K, V>>, kept up to date like a pmapView: update(newSource)
+// moves only the entries that changed and drops groups left empty.
+template <typename K, typename V, typename G>
+class groupedView {
+public:
+   typedef std::function<G(const V&)> grouping;
+
+   groupedView(const pmap<K, V>& source, const grouping& group) : group(group) {
+      for (const auto& kv : source) {
+         add(kv.first, kv.second);
+      }
+      src = source;
+   }
+
+   const pmap<G, pmap<K, V>>& value() const { return result; }
+   const pmap<K, V>& source() const { return src; }
+
+   const pmap<G, pmap<K, V>>& update(const pmap<K, V>& newSource) {
+      mapDiff<K, V> changes = diff(src, newSource);
+      for (const auto& kv : changes.removed) {
+         remove(kv.first, kv.second);
+      }
+      for (const auto& kv : changes.changed) {
+         remove(kv.first, kv.second.first);
+         add(kv.first, kv.second.second);
+      }
+      for (const auto& kv : changes.added) {
+         add(kv.first, kv.second);
+      }
+      src = newSource;
+      return result;
+   }
+
+private:
+   void add(const K& key, const V& val) {
+      G g = group(val);
+      const pmap<K, V>* members = result.valAt(g);
+      result = result.assoc(g, (members ? *members : pmap<K, V>()).assoc(key, val));
+   }
+
+   void remove(const K& key, const V& val) {
+      G g = group(val);
+      const pmap<K, V>* members = result.valAt(g);
+      if (!members) {
+         return;
+      }
+      pmap<K, V> rest = members->dissoc(key);
+      result = rest.empty() ? result.dissoc(g) : result.assoc(g, rest);
+   }
+
+   pmap<K, V> src;
+   pmap<G, pmap<K, V>> result;
+   grouping group;
+};
+
+// __groupByView(source, func)__.
+// An incremental grouping of the entries of a pmap by func(val).
+template <typename K, typename V, typename F>
+auto groupByView(const pmap<K, V>& source, const F& func) -> groupedView<K, V, decltype(func(std::declval<V>()))> {
+   return groupedView<K, V, decltype(func(std::declval<V>()))>(source, func);
+}
+
+// ## Concurrency.
+
+// __threadPool(nthreads)__.
+// A fixed set of worker threads running submitted tasks in FIFO order.
+// threadPool::shared() is the pool used by the library's background work.
+class threadPool {
+public:
+   explicit threadPool(unsigned nthreads = std::max(2u, std::thread::hardware_concurrency())) : stopping(false) {
+      for (unsigned i = 0; i < nthreads; ++i) {
+         workers.push_back(std::thread([this]() { work(); }));
+      }
+   }
+   threadPool(const threadPool&) = delete;
+   threadPool& operator=(const threadPool&) = delete;
+
+   // Runs the tasks already submitted, then stops the workers.
+   ~threadPool() {
+      {
+         std::lock_guard<std::mutex> guard(lock);
+         stopping = true;
+      }
+      wake.notify_all();
+      for (auto& worker : workers) {
+         worker.join();
+      }
+   }
+
+   void submit(std::function<void()> task) {
+      {
+         std::lock_guard<std::mutex> guard(lock);
+         tasks.push_back(std::move(task));
+      }
+      wake.notify_one();
+   }
+
+   size_t size() const { return workers.size(); }
+
+   static threadPool& shared() {
+      static threadPool pool;
+      return pool;
+   }
+
+private:
+   void work() {
+      for (;;) {
+         std::function<void()> task;
+         {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [this]() { return stopping || !tasks.empty(); });
+            if (tasks.empty()) {
+               return;
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+         }
+         task();
+      }
+   }
+
+   std::mutex lock;
+   std::condition_variable wake;
+   std::deque<std::function<void()>> tasks;
+   std::vector<std::thread> workers;
+   bool stopping;
+};
+
+// __cancellationToken__.
+// Lets a caller stop a long-running operation. Operations that accept a
+// token check it between chunks of work and throw operationCancelled
+// once it is cancelled or its deadline has passed. Copies share state, so
+// one copy can be cancelled from another thread.
+//
+// `cancellationToken token = cancellationToken::withTimeout(std::chrono::seconds(2));`
+class operationCancelled : public std::runtime_error {
+public:
+   operationCancelled() : std::runtime_error("operation cancelled") {}
+};
+
+class cancellationToken {
+public:
+   typedef std::chrono::steady_clock clock;
+
+   cancellationToken() : state(std::make_shared<tokenState>(clock::time_point::max())) {}
+
+   // __cancellationToken::withDeadline(deadline)__.
+   // Returns a token that cancels itself at deadline.
+   static cancellationToken withDeadline(clock::time_point deadline) {
+      cancellationToken token;
+      token.state->deadline = deadline;
+      token.state->hasDeadline = true;
+      return token;
+   }
+
+   // __cancellationToken::withTimeout(timeout)__.
+   // Returns a token that cancels itself after timeout.
+   template <typename R, typename P>
+   static cancellationToken withTimeout(const std::chrono::duration<R, P>& timeout) {
+      return withDeadline(clock::now() + std::chrono::duration_cast<clock::duration>(timeout));
+   }
+
+   void cancel() const {
+      state->cancelled.store(true, std::memory_order_relaxed);
+   }
+
+   bool isCancelled() const {
+      if (state->cancelled.load(std::memory_order_relaxed)) {
+         return true;
+      }
+      if (state->hasDeadline && clock::now() >= state->deadline) {
+         state->cancelled.store(true, std::memory_order_relaxed);
+         return true;
+      }
+      return false;
+   }
+
+   void throwIfCancelled() const {
+      if (isCancelled()) {
+         throw operationCancelled();
+      }
+   }
+
+   void operator()() const {
+      throwIfCancelled();
+   }
+
+private:
+   struct tokenState {
+      explicit tokenState(clock::time_point deadline) : cancelled(false), hasDeadline(false), deadline(deadline) {}
+      std::atomic<bool> cancelled;
+      bool hasDeadline;
+      clock::time_point deadline;
+   };
+   std::shared_ptr<tokenState> state;
+};
+
+namespace sanity_detail {
+
+// A shared_ptr updated atomically: std::atomic<std::shared_ptr> where the
+// library has it, otherwise the C++11 atomic shared_ptr functions.
+// Neither is lock-free in common standard libraries; libstdc++ guards the
+// C++11 functions with a small pool of mutexes.
+template <typename T>
+class atomicSnapshot {
+public:
+   typedef std::shared_ptr<const T> snapshot;
+
+   explicit atomicSnapshot(const snapshot& val) : val(val) {}
+
+#if defined(__cpp_lib_atomic_shared_ptr)
+   snapshot load() const { return val.load(); }
+   void store(const snapshot& next) { val.store(next); }
+   bool compareExchangeWeak(snapshot& expected, const snapshot& next) { return val.compare_exchange_weak(expected, next); }
+   bool compareExchangeStrong(snapshot& expected, const snapshot& next) { return val.compare_exchange_strong(expected, next); }
+
+private:
+   std::atomic<snapshot> val;
+#else
+   snapshot load() const { return std::atomic_load(&val); }
+   void store(const snapshot& next) { std::atomic_store(&val, next); }
+   bool compareExchangeWeak(snapshot& expected, const snapshot& next) { return std::atomic_compare_exchange_weak(&val, &expected, next); }
+   bool compareExchangeStrong(snapshot& expected, const snapshot& next) { return std::atomic_compare_exchange_strong(&val, &expected, next); }
+
+private:
+   snapshot val;
+#endif
+};
+
+} // namespace sanity_detail
+
+// __atom<T>__.
+// A shared, thread-safe reference to an immutable value of type T. Readers
+// take a snapshot with deref(); writers replace the whole value at once.
+// Old values stay alive for as long as some reader holds their snapshot.
+// Updates are compare-and-set retry loops over an atomic shared_ptr,
+// which standard libraries usually implement with internal locks, so
+// atoms are thread-safe but not lock-free.
+template <typename T>
+class atom {
+public:
+   typedef std::shared_ptr<const T> snapshot;
+   typedef std::function<void(const snapshot& oldVal, const snapshot& newVal)> watchFunction;
+
+   explicit atom(const T& val = T()) : core(std::make_shared<atomCore>(std::make_shared<const T>(val))) {}
+   atom(const atom&) = delete;
+   atom& operator=(const atom&) = delete;
+
+   // __deref()__.
+   // Returns the current value.
+   snapshot deref() const {
+      return core->state.load();
+   }
+
+   // __swap(func, args...)__.
+   // Sets the value to func(value, args...) and returns the new value.
+   // func may be called several times if other threads update the atom
+   // concurrently, so it should be free of side effects.
+   template <typename F, typename... ARGS>
+   snapshot swap(const F& func, const ARGS&... args) {
+      snapshot old = core->state.load();
+      for (;;) {
+         snapshot next = std::make_shared<const T>(func(*old, args...));
+         if (core->state.compareExchangeWeak(old, next)) {
+            notifyWatches();
+            return next;
+         }
+      }
+   }
+
+   // __reset(val)__.
+   // Sets the value to val, regardless of the current value.
+   snapshot reset(const T& val) {
+      snapshot next = std::make_shared<const T>(val);
+      core->state.store(next);
+      notifyWatches();
+      return next;
+   }
+
+   // __compareAndSet(old, val)__.
+   // Sets the value to val only if the current value is still the snapshot old.
+   bool compareAndSet(snapshot old, const T& val) {
+      if (core->state.compareExchangeStrong(old, std::make_shared<const T>(val))) {
+         notifyWatches();
+         return true;
+      }
+      return false;
+   }
+
+   // __addWatch(key, func)__.
+   // Calls func(old, new) on threadPool::shared() after the value changes.
+   // Changes made in quick succession are coalesced: func sees the value
+   // before the first of them and the value after the last. Writers never
+   // wait for watches to run. Exceptions thrown by func are ignored.
+   void addWatch(const std::string& key, const watchFunction& func) {
+      std::lock_guard<std::mutex> guard(core->watchLock);
+      if (core->watches.empty()) {
+         core->lastNotified = deref();
+      }
+      core->watches[key] = func;
+      core->hasWatches.store(true);
+   }
+
+   // __removeWatch(key)__.
+   // Removes the watch added under key.
+   void removeWatch(const std::string& key) {
+      std::lock_guard<std::mutex> guard(core->watchLock);
+      core->watches.erase(key);
+      core->hasWatches.store(!core->watches.empty());
+   }
+
+private:
+   // Shared with in-flight notification tasks, which may outlive the atom.
+   struct atomCore {
+      explicit atomCore(const snapshot& state) : state(state), hasWatches(false), dispatching(false), dirty(false) {}
+      sanity_detail::atomicSnapshot<T> state;
+      std::atomic<bool> hasWatches;
+      std::mutex watchLock;
+      std::map<std::string, watchFunction> watches;
+      snapshot lastNotified;
+      bool dispatching;
+      bool dirty;
+   };
+
+   void notifyWatches() {
+      if (!core->hasWatches.load()) {
+         return;
+      }
+      {
+         std::lock_guard<std::mutex> guard(core->watchLock);
+         core->dirty = true;
+         if (core->dispatching) {
+            return;
+         }
+         core->dispatching = true;
+      }
+      std::shared_ptr<atomCore> c = core;
+      threadPool::shared().submit([c]() { dispatch(*c); });
+   }
+
+   // Delivers batches until no changes are pending. Only one dispatch per
+   // atom runs at a time, so watches see changes in order.
+   static void dispatch(atomCore& c) {
+      for (;;) {
+         snapshot oldVal;
+         snapshot newVal;
+         std::map<std::string, watchFunction> watches;
+         {
+            std::lock_guard<std::mutex> guard(c.watchLock);
+            if (!c.dirty) {
+               c.dispatching = false;
+               return;
+            }
+            c.dirty = false;
+            oldVal = c.lastNotified;
+            newVal = c.state.load();
+            c.lastNotified = newVal;
+            watches = c.watches;
+         }
+         if (oldVal != newVal) {
+            for (auto& watch : watches) {
+               // A failing watch must not stop the others or the pool thread.
+               try {
+                  watch.second(oldVal, newVal);
+               } catch (...) {
+               }
+            }
+         }
+      }
+   }
+
+   std::shared_ptr<atomCore> core;
+};
+
+// __ref<T>__ and __dosync(func)__.
+// Software transactional memory: refs hold immutable values that are
+// read and updated together inside dosync transactions. A transaction
+// sees a consistent snapshot of every ref as of its start, and its
+// writes become visible atomically when it commits. Conflicting commits
+// are detected optimistically and the losing transaction is retried, so
+// transaction bodies should be free of side effects.
+//
+// `dosync([&](transaction& tx) { tx.alter(from, subtract, 10); tx.alter(to, add, 10); })`
+
+class transaction;
+
+namespace sanity_detail {
+
+struct retryTransaction {};
+
+// The commit clock: every committed transaction gets a new point.
+inline std::atomic<unsigned long long>& stmClock() {
+   static std::atomic<unsigned long long> clock(0);
+   return clock;
+}
+
+class refBase {
+public:
+   virtual ~refBase() {}
+
+protected:
+   friend class ::transaction;
+   virtual unsigned long long latestPoint() const = 0;
+   // Returns the newest value committed at or before point, or null.
+   virtual std::shared_ptr<const void> valueAt(unsigned long long point) const = 0;
+   virtual void commit(unsigned long long point, const std::shared_ptr<const void>& val) = 0;
+   mutable std::mutex lock;
+};
+
+} // namespace sanity_detail
+
+template <typename T>
+class ref : public sanity_detail::refBase {
+public:
+   typedef std::shared_ptr<const T> snapshot;
+
+   // maxHistory bounds the number of old versions kept for slow readers.
+   explicit ref(const T& val = T(), size_t maxHistory = 10) : maxHistory(std::max<size_t>(maxHistory, 1)) {
+      history.push_back(version(0, std::make_shared<const T>(val)));
+   }
+   ref(const ref&) = delete;
+   ref& operator=(const ref&) = delete;
+
+   // __deref()__.
+   // Returns the latest committed value, outside of any transaction.
+   snapshot deref() const {
+      std::lock_guard<std::mutex> guard(lock);
+      return history.back().second;
+   }
+
+private:
+   typedef std::pair<unsigned long long, snapshot> version;
+
+   unsigned long long latestPoint() const {
+      return history.back().first;
+   }
+
+   std::shared_ptr<const void> valueAt(unsigned long long point) const {
+      std::lock_guard<std::mutex> guard(lock);
+      for (auto iter = history.rbegin(); iter != history.rend(); ++iter) {
+         if (iter->first <= point) {
+            return iter->second;
+         }
+      }
+      return std::shared_ptr<const void>();
+   }
+
+   void commit(unsigned long long point, const std::shared_ptr<const void>& val) {
+      history.push_back(version(point, std::static_pointer_cast<const T>(val)));
+      if (history.size() > maxHistory) {
+         history.pop_front();
+      }
+   }
+
+   size_t maxHistory;
+   std::deque<version> history;
+};
+
+// A transaction in progress. Only valid inside the dosync call that created it.
+// References returned by get, set, alter and ensure stay valid until the
+// transaction ends, even after a later set of the same ref.
+class transaction {
+public:
+   // __get(ref)__.
+   // Returns the value of ref in this transaction's snapshot.
+   template <typename T>
+   const T& get(ref<T>& r) {
+      sanity_detail::refBase* base = &r;
+      auto found = values.find(base);
+      if (found == values.end()) {
+         std::shared_ptr<const void> val = base->valueAt(readPoint);
+         if (!val) {
+            // All versions old enough for us were discarded; start over.
+            throw sanity_detail::retryTransaction();
+         }
+         found = values.insert(std::make_pair(base, entry(val))).first;
+      }
+      return *std::static_pointer_cast<const T>(found->second.val);
+   }
+
+   // __set(ref, val)__.
+   // Sets the value of ref when the transaction commits.
+   template <typename T>
+   const T& set(ref<T>& r, const T& val) {
+      entry& e = values[&r];
+      if (e.val) {
+         replaced.push_back(e.val);
+      }
+      e.val = std::make_shared<const T>(val);
+      e.written = true;
+      return *std::static_pointer_cast<const T>(e.val);
+   }
+
+   // __alter(ref, func, args...)__.
+   // Sets the value of ref to func(value, args...).
+   template <typename T, typename F, typename... ARGS>
+   const T& alter(ref<T>& r, const F& func, const ARGS&... args) {
+      return set(r, T(func(get(r), args...)));
+   }
+
+   // __ensure(ref)__.
+   // Fails the commit if another transaction changes ref first, even
+   // though this transaction does not write it.
+   template <typename T>
+   const T& ensure(ref<T>& r) {
+      const T& val = get(r);
+      values[&r].ensured = true;
+      return val;
+   }
+
+private:
+   template <typename F> friend auto dosync(const F& func) -> decltype(func(std::declval<transaction&>()));
+
+   struct entry {
+      entry() : written(false), ensured(false) {}
+      explicit entry(const std::shared_ptr<const void>& val) : val(val), written(false), ensured(false) {}
+      std::shared_ptr<const void> val;
+      bool written;
+      bool ensured;
+   };
+
+   transaction() : readPoint(sanity_detail::stmClock().load()) {}
+
+   // Publishes the written values, or returns false if another transaction
+   // committed to one of our written or ensured refs after we started.
+   // Refs are locked in address order so concurrent commits can't deadlock.
+   bool commit() {
+      std::vector<std::unique_lock<std::mutex>> locks;
+      for (auto& kv : values) {
+         if (kv.second.written || kv.second.ensured) {
+            locks.push_back(std::unique_lock<std::mutex>(kv.first->lock));
+            if (kv.first->latestPoint() > readPoint) {
+               return false;
+            }
+         }
+      }
+      unsigned long long point = ++sanity_detail::stmClock();
+      for (auto& kv : values) {
+         if (kv.second.written) {
+            kv.first->commit(point, kv.second.val);
+         }
+      }
+      return true;
+   }
+
+   unsigned long long readPoint;
+   std::map<sanity_detail::refBase*, entry> values;
+   // Values overwritten by set, kept alive for references handed out earlier.
+   std::vector<std::shared_ptr<const void>> replaced;
+};
+
+namespace sanity_detail {
+
+inline transaction*& currentTransaction() {
+   static thread_local transaction* current = nullptr;
+   return current;
+}
+
+template <typename R>
+struct transactionResult {
+   template <typename F>
+   explicit transactionResult(const F& func, transaction& tx) : val(func(tx)) {}
+   R get() { return std::move(val); }
+   R val;
+};
+
+template <>
+struct transactionResult<void> {
+   template <typename F>
+   explicit transactionResult(const F& func, transaction& tx) { func(tx); }
+   void get() {}
+};
+
+} // namespace sanity_detail
+
+// __dosync(func)__.
+// Runs func(transaction&) as a transaction, retrying it until it commits,
+// and returns its result. A nested dosync joins the enclosing transaction.
+template <typename F>
+auto dosync(const F& func) -> decltype(func(std::declval<transaction&>())) {
+   typedef decltype(func(std::declval<transaction&>())) R;
+   transaction*& current = sanity_detail::currentTransaction();
+   if (current) {
+      return func(*current);
+   }
+   for (;;) {
+      transaction tx;
+      current = &tx;
+      try {
+         sanity_detail::transactionResult<R> result(func, tx);
+         current = nullptr;
+         if (tx.commit()) {
+            return result.get();
+         }
+      } catch (const sanity_detail::retryTransaction&) {
+         current = nullptr;
+      } catch (...) {
+         current = nullptr;
+         throw;
+      }
+      std::this_thread::yield();
+   }
+}
+
+// __rcu<T>__.
+// A read-mostly container for an immutable value, in the style of
+// read-copy-update. Readers get the current version with a wait-free load
+// that touches no shared counters; writers publish a complete new version
+// atomically. Old versions are freed with epoch-based reclamation once no
+// reader that could have seen them is still reading, by the writer or by
+// the last such reader as it finishes. Reads are wait-free for the first
+// 128 reading threads alive at once; threads beyond that announce their
+// reads under a shared lock instead.
+//
+// `auto table = lookups.read(); use(table->at(key));`
+
+namespace sanity_detail {
+
+// A single epoch domain shared by every rcu. Each reading thread owns a
+// slot announcing the epoch in which its current read began (0 = idle).
+// Threads that find every slot taken record their epochs in a locked
+// overflow set instead.
+class epochDomain {
+public:
+   static const unsigned slotCount = 128;
+
+   static epochDomain& instance() {
+      static epochDomain domain;
+      return domain;
+   }
+
+   // Marks the calling thread as reading; returns its slot.
+   void enter() {
+      threadSlot& slot = currentSlot();
+      if (slot.depth++ > 0) {
+         return;
+      }
+      if (slot.slot) {
+         slot.slot->store(epoch.load());
+      } else {
+         std::lock_guard<std::mutex> guard(overflowLock);
+         slot.overflowEpoch = epoch.load();
+         overflow.insert(slot.overflowEpoch);
+      }
+   }
+
+   // Ends the calling thread's read, freeing whatever it was the last to see.
+   void exit() {
+      threadSlot& slot = currentSlot();
+      if (--slot.depth > 0) {
+         return;
+      }
+      unsigned long long entered = slot.overflowEpoch;
+      if (slot.slot) {
+         entered = slot.slot->load();
+         slot.slot->store(0);
+      } else {
+         std::lock_guard<std::mutex> guard(overflowLock);
+         overflow.erase(overflow.find(entered));
+      }
+      // Only reads begun before the last retire can be holding anything back.
+      if (pending.load() > 0 && entered <= lastRetired.load()) {
+         collect();
+      }
+   }
+
+   // Frees obj with deleter once every reader that might see it has finished.
+   // Call only after obj has been unpublished.
+   void retire(void* obj, void (*deleter)(void*)) {
+      unsigned long long retiredIn = epoch.fetch_add(1);
+      {
+         std::lock_guard<std::mutex> guard(lock);
+         retired.push_back(retiredObject(retiredIn, obj, deleter));
+         pending.store(retired.size());
+         lastRetired.store(retiredIn);
+      }
+      collect();
+   }
+
+   // Frees every retired object that no reader can still see.
+   void collect() {
+      std::vector<retiredObject> ready;
+      {
+         std::unique_lock<std::mutex> guard(lock, std::defer_lock);
+         if (!guard.try_lock()) {
+            return;
+         }
+         unsigned long long oldest = epoch.load();
+         for (unsigned i = 0; i < slotCount; ++i) {
+            unsigned long long e = slots[i].val.load();
+            if (e != 0 && e < oldest) {
+               oldest = e;
+            }
+         }
+         {
+            std::lock_guard<std::mutex> overflowGuard(overflowLock);
+            if (!overflow.empty()) {
+               oldest = std::min(oldest, *overflow.begin());
+            }
+         }
+         auto kept = std::partition(retired.begin(), retired.end(),
+                                    [oldest](const retiredObject& r) { return r.epoch >= oldest; });
+         ready.assign(kept, retired.end());
+         retired.erase(kept, retired.end());
+         pending.store(retired.size());
+      }
+      for (auto& r : ready) {
+         r.deleter(r.obj);
+      }
+   }
+
+private:
+   struct retiredObject {
+      retiredObject(unsigned long long epoch, void* obj, void (*deleter)(void*)) : epoch(epoch), obj(obj), deleter(deleter) {}
+      unsigned long long epoch;
+      void* obj;
+      void (*deleter)(void*);
+   };
+
+   // One slot per cache line so readers don't contend with each other.
+   struct alignas(64) paddedSlot {
+      paddedSlot() : val(0), owned(false) {}
+      std::atomic<unsigned long long> val;
+      std::atomic<bool> owned;
+   };
+
+   // Claims a free slot for the life of the calling thread, if there is one.
+   struct threadSlot {
+      threadSlot() : slot(nullptr), owner(nullptr), depth(0), overflowEpoch(0) {
+         epochDomain& domain = instance();
+         for (unsigned i = 0; i < slotCount; ++i) {
+            bool expected = false;
+            if (domain.slots[i].owned.compare_exchange_strong(expected, true)) {
+               slot = &domain.slots[i].val;
+               owner = &domain.slots[i].owned;
+               return;
+            }
+         }
+      }
+      ~threadSlot() {
+         if (owner) {
+            owner->store(false);
+         }
+      }
+      std::atomic<unsigned long long>* slot;
+      std::atomic<bool>* owner;
+      unsigned depth;
+      unsigned long long overflowEpoch;
+   };
+
+   static threadSlot& currentSlot() {
+      static thread_local threadSlot slot;
+      return slot;
+   }
+
+   epochDomain() : epoch(1), pending(0), lastRetired(0) {}
+
+   std::atomic<unsigned long long> epoch;
+   paddedSlot slots[slotCount];
+   std::mutex lock;
+   std::vector<retiredObject> retired;
+   // The size of retired, readable without the lock.
+   std::atomic<size_t> pending;
+   std::atomic<unsigned long long> lastRetired;
+   std::mutex overflowLock;
+   std::multiset<unsigned long long> overflow;
+};
+
+} // namespace sanity_detail
+
+template <typename T>
+class rcu {
+public:
+   // Keeps the version that was current at construction alive while in scope.
+   class readGuard {
+   public:
+      readGuard(readGuard&& other) : val(other.val) { other.val = nullptr; }
+      ~readGuard() {
+         if (val) {
+            sanity_detail::epochDomain::instance().exit();
+         }
+      }
+      const T& operator*() const { return *val; }
+      const T* operator->() const { return val; }
+
+   private:
+      friend class rcu;
+      explicit readGuard(const std::atomic<const T*>& current) {
+         sanity_detail::epochDomain::instance().enter();
+         val = current.load();
+      }
+      readGuard(const readGuard&) = delete;
+      readGuard& operator=(const readGuard&) = delete;
+      const T* val;
+   };
+
+   explicit rcu(const T& val = T()) : current(new T(val)) {}
+   rcu(const rcu&) = delete;
+   rcu& operator=(const rcu&) = delete;
+   ~rcu() {
+      sanity_detail::epochDomain::instance().collect();
+      delete current.load();
+   }
+
+   // __read()__.
+   // Returns a guard giving access to the current version.
+   readGuard read() const {
+      return readGuard(current);
+   }
+
+   // __publish(val)__.
+   // Makes val the current version.
+   void publish(const T& val) {
+      std::lock_guard<std::mutex> guard(writeLock);
+      replace(new T(val));
+   }
+
+   // __update(func, args...)__.
+   // Publishes func(current, args...). Concurrent updates are serialized.
+   template <typename F, typename... ARGS>
+   void update(const F& func, const ARGS&... args) {
+      std::lock_guard<std::mutex> guard(writeLock);
+      replace(new T(func(*current.load(), args...)));
+   }
+
+private:
+   static void destroy(void* obj) {
+      delete static_cast<const T*>(obj);
+   }
+
+   void replace(const T* next) {
+      const T* old = current.exchange(next);
+      sanity_detail::epochDomain::instance().retire(const_cast<T*>(old), &rcu::destroy);
+   }
+
+   std::atomic<const T*> current;
+   std::mutex writeLock;
+};
+
+// __chan<T>(capacity)__.
+// A bounded channel connecting threads, in the style of core.async.
+// Producers put values and consumers take them in FIFO order; a full
+// channel makes put wait, which gives backpressure between stages.
+// Copies of a chan refer to the same channel, and the channel closes when
+// the last of them is gone. The threads started by pipe, merge, split,
+// map, filter and toChan write through weak() copies, so dropping a
+// channel they feed stops them instead of leaving them blocked.
+//
+// `chan<int> c(16); c.put(1); int x; c.take(x); c.close();`
+
+namespace sanity_detail {
+
+// Bounded multi-producer multi-consumer lock-free queue (D. Vyukov's
+// algorithm). Each cell carries a sequence number telling producers and
+// consumers whose turn it is.
+template <typename T>
+class mpmcRing {
+public:
+   explicit mpmcRing(size_t capacity) : mask(roundUp(capacity) - 1), cells(mask + 1), head(0), tail(0) {
+      for (size_t i = 0; i <= mask; ++i) {
+         cells[i].sequence.store(i);
+      }
+   }
+   mpmcRing(const mpmcRing&) = delete;
+   mpmcRing& operator=(const mpmcRing&) = delete;
+   ~mpmcRing() {
+      T val;
+      while (tryPop(val)) {
+      }
+   }
+
+   bool tryPush(const T& val) {
+      size_t pos = tail.load(std::memory_order_relaxed);
+      for (;;) {
+         cell& c = cells[pos & mask];
+         size_t seq = c.sequence.load(std::memory_order_acquire);
+         std::ptrdiff_t diff = (std::ptrdiff_t) seq - (std::ptrdiff_t) pos;
+         if (diff == 0) {
+            if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+               new (c.storage) T(val);
+               c.sequence.store(pos + 1, std::memory_order_release);
+               return true;
+            }
+         } else if (diff < 0) {
+            return false;
+         } else {
+            pos = tail.load(std::memory_order_relaxed);
+         }
+      }
+   }
+
+   bool tryPop(T& out) {
+      size_t pos = head.load(std::memory_order_relaxed);
+      for (;;) {
+         cell& c = cells[pos & mask];
+         size_t seq = c.sequence.load(std::memory_order_acquire);
+         std::ptrdiff_t diff = (std::ptrdiff_t) seq - (std::ptrdiff_t) (pos + 1);
+         if (diff == 0) {
+            if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+               T* val = reinterpret_cast<T*>(c.storage);
+               out = std::move(*val);
+               val->~T();
+               c.sequence.store(pos + mask + 1, std::memory_order_release);
+               return true;
+            }
+         } else if (diff < 0) {
+            return false;
+         } else {
+            pos = head.load(std::memory_order_relaxed);
+         }
+      }
+   }
+
+   size_t size() const {
+      size_t t = tail.load(std::memory_order_relaxed);
+      size_t h = head.load(std::memory_order_relaxed);
+      return t > h ? t - h : 0;
+   }
+
+   size_t capacity() const { return mask + 1; }
+
+private:
+   struct cell {
+      std::atomic<size_t> sequence;
+      alignas(T) unsigned char storage[sizeof(T)];
+   };
+
+   // At least two cells: with one, a full ring looks like an empty one.
+   static size_t roundUp(size_t n) {
+      size_t result = 2;
+      while (result < n) {
+         result *= 2;
+      }
+      return result;
+   }
+
+   size_t mask;
+   std::vector<cell> cells;
+   alignas(64) std::atomic<size_t> head;
+   alignas(64) std::atomic<size_t> tail;
+};
+
+} // namespace sanity_detail
+
+template <typename T>
+class chan {
+public:
+   typedef T value_type;
+
+   explicit chan(size_t capacity = 1024)
+      : state(std::make_shared<channelState>(capacity)), owner(std::make_shared<closer>(state)) {}
+
+   // __weak()__.
+   // Returns a copy that uses the channel without keeping it open.
+   chan weak() const {
+      chan result(*this);
+      result.owner.reset();
+      return result;
+   }
+
+   // __offer(val)__.
+   // Puts val without waiting. Returns false if the channel is full or closed.
+   bool offer(const T& val) const {
+      if (state->closed.load() || !state->ring.tryPush(val)) {
+         return false;
+      }
+      wakeUp(state->takers, state->notEmpty);
+      return true;
+   }
+
+   // __put(val)__.
+   // Puts val, waiting while the channel is full. Returns false if the
+   // channel is closed.
+   bool put(const T& val) const {
+      for (int spins = 0; ; ++spins) {
+         if (offer(val)) {
+            return true;
+         }
+         if (state->closed.load()) {
+            return false;
+         }
+         if (spins >= spinLimit) {
+            waitUntil(state->putters, state->notFull, [&]() { return state->closed.load() || state->ring.size() < state->ring.capacity(); });
+            spins = 0;
+         }
+      }
+   }
+
+   // __poll(out)__.
+   // Takes a value into out without waiting. Returns false if there is none.
+   bool poll(T& out) const {
+      if (!state->ring.tryPop(out)) {
+         return false;
+      }
+      wakeUp(state->putters, state->notFull);
+      return true;
+   }
+
+   // __take(out)__.
+   // Takes a value into out, waiting while the channel is empty. Returns
+   // false once the channel is closed and drained.
+   bool take(T& out) const {
+      for (int spins = 0; ; ++spins) {
+         if (poll(out)) {
+            return true;
+         }
+         if (state->closed.load()) {
+            // Values put before close are still delivered.
+            return poll(out);
+         }
+         if (spins >= spinLimit) {
+            waitUntil(state->takers, state->notEmpty, [&]() { return state->closed.load() || state->ring.size() > 0; });
+            spins = 0;
+         }
+      }
+   }
+
+   // __close()__.
+   // Stops the channel accepting values and wakes all waiting threads.
+   void close() const {
+      state->closed.store(true);
+      std::lock_guard<std::mutex> guard(state->lock);
+      state->notEmpty.notify_all();
+      state->notFull.notify_all();
+   }
+
+   bool closed() const { return state->closed.load(); }
+   size_t size() const { return state->ring.size(); }
+   size_t capacity() const { return state->ring.capacity(); }
+
+   bool operator==(const chan& other) const { return state == other.state; }
+
+private:
+   static const int spinLimit = 64;
+
+   struct channelState;
+
+   // Closes the channel when the last strong copy is destroyed.
+   struct closer {
+      explicit closer(const std::shared_ptr<channelState>& state) : state(state) {}
+      ~closer() { chan(state).close(); }
+      std::shared_ptr<channelState> state;
+   };
+
+   explicit chan(const std::shared_ptr<channelState>& state) : state(state) {}
+
+   struct channelState {
+      explicit channelState(size_t capacity) : ring(capacity), closed(false), takers(0), putters(0) {}
+      sanity_detail::mpmcRing<T> ring;
+      std::atomic<bool> closed;
+      std::atomic<int> takers;
+      std::atomic<int> putters;
+      std::mutex lock;
+      std::condition_variable notEmpty;
+      std::condition_variable notFull;
+   };
+
+   // Waiters register before re-checking under the lock, and wakers check
+   // for registered waiters after changing the ring. The fences on both
+   // sides keep either from reading stale state, so no wakeup is lost.
+   template <typename F>
+   void waitUntil(std::atomic<int>& waiters, std::condition_variable& cond, const F& ready) const {
+      ++waiters;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      {
+         std::unique_lock<std::mutex> guard(state->lock);
+         cond.wait(guard, ready);
+      }
+      --waiters;
+   }
+
+   void wakeUp(std::atomic<int>& waiters, std::condition_variable& cond) const {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (waiters.load() > 0) {
+         std::lock_guard<std::mutex> guard(state->lock);
+         cond.notify_all();
+      }
+   }
+
+   std::shared_ptr<channelState> state;
+   std::shared_ptr<closer> owner;
+};
+
+// __toChan(coll, capacity)__.
+// Returns a channel that receives the elements of coll and then closes.
+template <typename C>
+chan<typename C::value_type> toChan(const C& coll, size_t capacity = 1024) {
+   chan<typename C::value_type> out(capacity);
+   chan<typename C::value_type> sink = out.weak();
+   C copy(coll);
+   std::thread([copy, sink]() {
+      for (const auto& elem : copy) {
+         if (!sink.put(elem)) {
+            break;
+         }
+      }
+      sink.close();
+   }).detach();
+   return out;
+}
+
+// __takeAll(ch)__.
+// Takes values from ch until it closes and returns them in a vector.
+template <typename T>
+std::vector<T> takeAll(const chan<T>& ch) {
+   std::vector<T> result;
+   T val;
+   while (ch.take(val)) {
+      result.push_back(std::move(val));
+   }
+   return result;
+}
+
+// __pipe(from, to, closeWhenDone)__.
+// Moves every value from one channel to another on a background thread.
+template <typename T>
+void pipe(const chan<T>& from, const chan<T>& to, bool closeWhenDone = true) {
+   chan<T> sink = to.weak();
+   std::thread([from, sink, closeWhenDone]() {
+      T val;
+      while (from.take(val)) {
+         if (!sink.put(val)) {
+            break;
+         }
+      }
+      if (closeWhenDone) {
+         sink.close();
+      }
+   }).detach();
+}
+
+// __merge(chans, capacity)__.
+// Returns a channel receiving the values of all the input channels, which
+// closes when they have all closed.
+template <typename T>
+chan<T> merge(const std::vector<chan<T>>& chans, size_t capacity = 1024) {
+   chan<T> out(capacity);
+   chan<T> sink = out.weak();
+   auto remaining = std::make_shared<std::atomic<size_t>>(chans.size());
+   if (chans.empty()) {
+      out.close();
+   }
+   for (const auto& in : chans) {
+      std::thread([in, sink, remaining]() {
+         T val;
+         while (in.take(val)) {
+            if (!sink.put(val)) {
+               break;
+            }
+         }
+         if (--*remaining == 0) {
+            sink.close();
+         }
+      }).detach();
+   }
+   return out;
+}
+
+// __split(ch, predicate, capacity)__.
+// Returns a pair of channels: the values of ch where predicate(value) is
+// true, and those where it is false.
+template <typename T, typename F>
+std::pair<chan<T>, chan<T>> split(const chan<T>& ch, const F& predicate, size_t capacity = 1024) {
+   chan<T> yes(capacity);
+   chan<T> no(capacity);
+   chan<T> yesSink = yes.weak();
+   chan<T> noSink = no.weak();
+   std::thread([ch, yesSink, noSink, predicate]() {
+      T val;
+      while (ch.take(val)) {
+         // Values for a side that was dropped are discarded.
+         (predicate(val) ? yesSink : noSink).put(val);
+         if (yesSink.closed() && noSink.closed()) {
+            break;
+         }
+      }
+      yesSink.close();
+      noSink.close();
+   }).detach();
+   return std::make_pair(yes, no);
+}
+
+// __map(ch, func, capacity)__.
+// Returns a channel of func(value) for each value taken from ch.
+template <typename T, typename F>
+auto map(const chan<T>& ch, const F& func, size_t capacity = 1024) -> chan<decltype(func(std::declval<T>()))> {
+   chan<decltype(func(std::declval<T>()))> out(capacity);
+   chan<decltype(func(std::declval<T>()))> sink = out.weak();
+   std::thread([ch, sink, func]() {
+      T val;
+      while (ch.take(val)) {
+         if (!sink.put(func(val))) {
+            break;
+         }
+      }
+      sink.close();
+   }).detach();
+   return out;
+}
+
+// __filter(ch, predicate, capacity)__.
+// Returns a channel of the values taken from ch where predicate(value) is true.
+template <typename T, typename F>
+chan<T> filter(const chan<T>& ch, const F& predicate, size_t capacity = 1024) {
+   chan<T> out(capacity);
+   chan<T> sink = out.weak();
+   std::thread([ch, sink, predicate]() {
+      T val;
+      while (ch.take(val)) {
+         if (predicate(val) && !sink.put(val)) {
+            break;
+         }
+      }
+      sink.close();
+   }).detach();
+   return out;
+}
+
+// __pipeline<T>__.
+// Runs a chain of collection stages concurrently instead of materializing
+// the whole collection between them. Elements flow between stages in
+// batches over bounded channels, so a slow stage holds back the stages
+// before it (backpressure) and memory stays bounded by the batches in
+// flight. Expensive stages can run on several workers, keeping their
+// input order or not. stats() reports throughput and queue depth.
+//
+// `pipeline<std::string>::from(split(slurp(file), "\n")).map(parse, 8).filter(valid).reduce(0, add)`
+
+// Per-stage numbers reported by pipeline::stats().
+struct stageStats {
+   std::string name;
+   unsigned workers;
+   size_t itemsIn;
+   size_t itemsOut;
+   // Time spent in the stage function, summed over workers.
+   double busySeconds;
+   // Items taken in per second since the stage started.
+   double throughput;
+   // Batches waiting to enter the stage.
+   size_t queueDepth;
+};
+
+namespace sanity_detail {
+
+struct stageCounters {
+   stageCounters(const std::string& name, unsigned workers, const std::function<size_t()>& queueDepth)
+      : name(name), workers(workers), itemsIn(0), itemsOut(0), busyNanos(0), queueDepth(queueDepth),
+        started(std::chrono::steady_clock::now()) {}
+   std::string name;
+   unsigned workers;
+   std::atomic<size_t> itemsIn;
+   std::atomic<size_t> itemsOut;
+   std::atomic<long long> busyNanos;
+   std::function<size_t()> queueDepth;
+   std::chrono::steady_clock::time_point started;
+};
+
+// State shared by all stages of one pipeline.
+struct pipelineState {
+   explicit pipelineState(const cancellationToken& token) : token(token) {}
+   cancellationToken token;
+   std::mutex lock;
+   std::vector<std::shared_ptr<stageCounters>> stages;
+   std::exception_ptr error;
+
+   void fail(std::exception_ptr e) {
+      std::lock_guard<std::mutex> guard(lock);
+      if (!error) {
+         error = e;
+      }
+   }
+
+   void rethrow() {
+      std::lock_guard<std::mutex> guard(lock);
+      if (error) {
+         std::rethrow_exception(error);
+      }
+   }
+};
+
+// Bounds how far the workers of an ordered stage may run ahead of the
+// oldest batch still being worked on: a worker holding batch seq waits
+// until seq < released + size, so at most size batches wait to be put
+// back in order.
+struct reorderWindow {
+   explicit reorderWindow(size_t size) : size(size), released(0), stopped(false) {}
+
+   // Returns false if the stage stopped while waiting.
+   bool wait(size_t seq) {
+      std::unique_lock<std::mutex> guard(lock);
+      ready.wait(guard, [&]() { return stopped || seq < released + size; });
+      return !stopped;
+   }
+
+   void release(size_t count) {
+      std::lock_guard<std::mutex> guard(lock);
+      released = count;
+      ready.notify_all();
+   }
+
+   void stop() {
+      std::lock_guard<std::mutex> guard(lock);
+      stopped = true;
+      ready.notify_all();
+   }
+
+   std::mutex lock;
+   std::condition_variable ready;
+   size_t size;
+   size_t released;
+   bool stopped;
+};
+
+} // namespace sanity_detail
+
+template <typename T>
+class pipeline {
+public:
+   // A batch tagged with its position in the stream.
+   typedef std::pair<size_t, std::vector<T>> batch;
+
+   // __pipeline::from(coll, batchSize, maxInFlight, token)__.
+   // Starts a pipeline reading coll. At most maxInFlight batches of
+   // batchSize elements wait between any two stages. Every stage checks
+   // token between batches and stops with operationCancelled once it fires.
+   template <typename C>
+   static pipeline from(const C& coll, size_t batchSize = 256, size_t maxInFlight = 8,
+                        const cancellationToken& token = cancellationToken()) {
+      auto state = std::make_shared<sanity_detail::pipelineState>(token);
+      chan<batch> out(maxInFlight);
+      auto counters = addStage(*state, "from", 1, out);
+      chan<batch> sink = out.weak();
+      C copy(coll);
+      std::thread([copy, sink, counters, batchSize, state]() {
+         size_t seq = 0;
+         batch next(seq, std::vector<T>());
+         for (const auto& elem : copy) {
+            next.second.push_back(elem);
+            if (next.second.size() == batchSize) {
+               counters->itemsIn += batchSize;
+               counters->itemsOut += batchSize;
+               if (!emit(*state, sink, next)) {
+                  return;
+               }
+               next = batch(++seq, std::vector<T>());
+            }
+         }
+         counters->itemsIn += next.second.size();
+         counters->itemsOut += next.second.size();
+         if (!next.second.empty()) {
+            sink.put(next);
+         }
+         sink.close();
+      }).detach();
+      return pipeline(state, out, batchSize, maxInFlight);
+   }
+
+   // __pipeline::from(ch, batchSize, maxInFlight, token)__.
+   // Starts a pipeline reading values from a channel until it closes.
+   static pipeline from(const chan<T>& ch, size_t batchSize = 256, size_t maxInFlight = 8,
+                        const cancellationToken& token = cancellationToken()) {
+      auto state = std::make_shared<sanity_detail::pipelineState>(token);
+      chan<batch> out(maxInFlight);
+      auto counters = addStage(*state, "from", 1, out);
+      chan<batch> sink = out.weak();
+      std::thread([ch, sink, counters, batchSize, state]() {
+         size_t seq = 0;
+         batch next(seq, std::vector<T>());
+         T val;
+         while (ch.take(val)) {
+            ++counters->itemsIn;
+            next.second.push_back(val);
+            if (next.second.size() == batchSize) {
+               counters->itemsOut += batchSize;
+               if (!emit(*state, sink, next)) {
+                  return;
+               }
+               next = batch(++seq, std::vector<T>());
+            }
+         }
+         counters->itemsOut += next.second.size();
+         if (!next.second.empty()) {
+            sink.put(next);
+         }
+         sink.close();
+      }).detach();
+      return pipeline(state, out, batchSize, maxInFlight);
+   }
+
+   // __map(func, workers, ordered)__.
+   // Adds a stage applying func to each element on the given number of
+   // worker threads. Unordered stages emit batches as soon as they finish.
+   template <typename F>
+   auto map(const F& func, unsigned workers = 1, bool ordered = true, const std::string& name = "map") const
+         -> pipeline<decltype(func(std::declval<T>()))> {
+      typedef decltype(func(std::declval<T>())) R;
+      return stage<R>(name, workers, ordered, [func](const std::vector<T>& in, std::vector<R>& out) {
+         out.reserve(in.size());
+         for (const auto& elem : in) {
+            out.push_back(func(elem));
+         }
+      });
+   }
+
+   // __filter(predicate, workers, ordered)__.
+   // Adds a stage keeping the elements where predicate(elem) is true.
+   template <typename F>
+   pipeline filter(const F& predicate, unsigned workers = 1, bool ordered = true, const std::string& name = "filter") const {
+      return stage<T>(name, workers, ordered, [predicate](const std::vector<T>& in, std::vector<T>& out) {
+         for (const auto& elem : in) {
+            if (predicate(elem)) {
+               out.push_back(elem);
+            }
+         }
+      });
+   }
+
+   // __reduce(init, func)__.
+   // Runs the pipeline to completion, folding its output with func.
+   template <typename OUT, typename F>
+   OUT reduce(const OUT& init, const F& func) const {
+      OUT memo = init;
+      batch next;
+      while (output.take(next)) {
+         for (const auto& elem : next.second) {
+            memo = func(memo, elem);
+         }
+      }
+      state->rethrow();
+      return memo;
+   }
+
+   // __collect()__.
+   // Runs the pipeline to completion and returns its output.
+   std::vector<T> collect() const {
+      return reduce(std::vector<T>(), [](std::vector<T>& result, const T& elem) -> std::vector<T>& {
+         result.push_back(elem);
+         return result;
+      });
+   }
+
+   // __stats()__.
+   // Returns the current counters of every stage, source first.
+   std::vector<stageStats> stats() const {
+      std::vector<stageStats> result;
+      std::lock_guard<std::mutex> guard(state->lock);
+      auto now = std::chrono::steady_clock::now();
+      for (auto& counters : state->stages) {
+         stageStats s;
+         s.name = counters->name;
+         s.workers = counters->workers;
+         s.itemsIn = counters->itemsIn.load();
+         s.itemsOut = counters->itemsOut.load();
+         s.busySeconds = counters->busyNanos.load() / 1e9;
+         double elapsed = std::chrono::duration<double>(now - counters->started).count();
+         s.throughput = elapsed > 0 ? s.itemsIn / elapsed : 0;
+         s.queueDepth = counters->queueDepth();
+         result.push_back(s);
+      }
+      return result;
+   }
+
+private:
+   template <typename> friend class pipeline;
+
+   // Passes a full batch from a source on, unless the pipeline was cancelled.
+   static bool emit(sanity_detail::pipelineState& state, const chan<batch>& out, const batch& next) {
+      if (state.token.isCancelled()) {
+         state.fail(std::make_exception_ptr(operationCancelled()));
+         out.close();
+         return false;
+      }
+      return out.put(next);
+   }
+
+   pipeline(const std::shared_ptr<sanity_detail::pipelineState>& state, const chan<batch>& output, size_t batchSize, size_t maxInFlight)
+      : state(state), output(output), batchSize(batchSize), maxInFlight(maxInFlight) {}
+
+   template <typename B>
+   static std::shared_ptr<sanity_detail::stageCounters> addStage(sanity_detail::pipelineState& state, const std::string& name,
+                                                                unsigned workers, const chan<B>& input) {
+      chan<B> probe = input.weak();
+      auto counters = std::make_shared<sanity_detail::stageCounters>(name, workers, [probe]() { return probe.size(); });
+      std::lock_guard<std::mutex> guard(state.lock);
+      state.stages.push_back(counters);
+      return counters;
+   }
+
+   // Adds a stage transforming each batch with func(in, out) on workers threads.
+   template <typename R, typename F>
+   pipeline<R> stage(const std::string& name, unsigned workers, bool ordered, const F& func) const {
+      typedef typename pipeline<R>::batch outBatch;
+      workers = std::max(1u, workers);
+      chan<batch> in = output;
+      chan<outBatch> out(maxInFlight);
+      // Ordered stages hand finished batches to a thread that restores
+      // their sequence before passing them on. Batches arrive in sequence,
+      // and a window keeps workers from running more than maxInFlight
+      // batches ahead of the oldest one still in progress.
+      bool reorder = ordered && workers > 1;
+      chan<outBatch> done = reorder ? chan<outBatch>(maxInFlight + workers) : out;
+      // Workers and the reorder thread write through weak copies, so if the
+      // stage's output is dropped they stop rather than block forever.
+      chan<outBatch> doneSink = done.weak();
+      chan<outBatch> outSink = out.weak();
+      std::shared_ptr<sanity_detail::reorderWindow> window;
+      if (reorder) {
+         window = std::make_shared<sanity_detail::reorderWindow>(std::max<size_t>(maxInFlight, workers));
+      }
+      auto counters = addStage(*state, name, workers, in);
+      auto s = state;
+      auto remaining = std::make_shared<std::atomic<unsigned>>(workers);
+      // Renumbering and putting happen together, so batches leave in sequence.
+      auto nextSeq = std::make_shared<size_t>(0);
+      auto renumbering = std::make_shared<std::mutex>();
+      bool renumber = !reorder;
+      for (unsigned i = 0; i < workers; ++i) {
+         std::thread([in, doneSink, counters, s, remaining, nextSeq, renumbering, renumber, window, func]() {
+            try {
+               batch next;
+               while (in.take(next)) {
+                  if (window && !window->wait(next.first)) {
+                     break;
+                  }
+                  s->token.throwIfCancelled();
+                  outBatch result(next.first, std::vector<R>());
+                  auto begin = std::chrono::steady_clock::now();
+                  func(next.second, result.second);
+                  counters->busyNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+                  counters->itemsIn += next.second.size();
+                  counters->itemsOut += result.second.size();
+                  if (renumber) {
+                     if (result.second.empty()) {
+                        continue;
+                     }
+                     std::lock_guard<std::mutex> guard(*renumbering);
+                     result.first = (*nextSeq)++;
+                     if (!doneSink.put(result)) {
+                        break;
+                     }
+                  } else if (!doneSink.put(result)) {
+                     break;
+                  }
+               }
+            } catch (...) {
+               s->fail(std::current_exception());
+               in.close();
+               if (window) {
+                  window->stop();
+               }
+            }
+            if (--*remaining == 0) {
+               doneSink.close();
+            }
+         }).detach();
+      }
+      if (reorder) {
+         std::thread([done, outSink, window]() {
+            std::map<size_t, outBatch> pending;
+            size_t expected = 0;
+            size_t seq = 0;
+            bool open = true;
+            outBatch next;
+            while (open && done.take(next)) {
+               pending[next.first] = std::move(next);
+               for (auto iter = pending.begin(); open && iter != pending.end() && iter->first == expected; iter = pending.erase(iter)) {
+                  ++expected;
+                  if (!iter->second.second.empty()) {
+                     iter->second.first = seq++;
+                     open = outSink.put(iter->second);
+                  }
+               }
+               window->release(expected);
+            }
+            window->stop();
+            done.close();
+            outSink.close();
+         }).detach();
+      }
+      return pipeline<R>(state, out, batchSize, maxInFlight);
+   }
+
+   std::shared_ptr<sanity_detail::pipelineState> state;
+   chan<batch> output;
+   size_t batchSize;
+   size_t maxInFlight;
+};
+
+// __future<T>__, __promise<T>__ and __delay(func)__.
+// A future holds a value that will be computed later, on
+// threadPool::shared(). Rather than blocking a thread in get(), chain
+// work with then(): the continuation is queued on the pool when the
+// value is ready. Errors thrown by a computation are rethrown by get()
+// and passed along by then(). Computations returning void give a
+// future<void>, which only signals completion.
+//
+// `futureCall([&]() { return slurp(file); }).then([](const std::string& s) { return split(s, "\n"); })`
+
+template <typename T> class future;
+template <typename T> class promise;
+
+namespace sanity_detail {
+
+// What a futureState holds: the value, or a placeholder for future<void>.
+template <typename T>
+struct futureStorage {
+   typedef T type;
+};
+
+template <>
+struct futureStorage<void> {
+   typedef bool type;
+};
+
+template <typename T>
+struct futureState {
+   typedef typename futureStorage<T>::type stored;
+
+   futureState() : ready(false) {}
+
+   void complete(std::unique_ptr<stored> val, std::exception_ptr e) {
+      std::vector<std::function<void()>> continuations;
+      {
+         std::lock_guard<std::mutex> guard(lock);
+         if (ready) {
+            throw std::runtime_error("future already completed");
+         }
+         value = std::move(val);
+         error = e;
+         ready = true;
+         continuations.swap(waiting);
+      }
+      readyCondition.notify_all();
+      for (auto& continuation : continuations) {
+         threadPool::shared().submit(continuation);
+      }
+   }
+
+   // Queues func on the pool once the value is ready.
+   void onReady(const std::function<void()>& func) {
+      {
+         std::lock_guard<std::mutex> guard(lock);
+         if (!ready) {
+            waiting.push_back(func);
+            return;
+         }
+      }
+      threadPool::shared().submit(func);
+   }
+
+   const stored& get() {
+      std::unique_lock<std::mutex> guard(lock);
+      readyCondition.wait(guard, [this]() { return ready; });
+      if (error) {
+         std::rethrow_exception(error);
+      }
+      return *value;
+   }
+
+   std::mutex lock;
+   std::condition_variable readyCondition;
+   bool ready;
+   std::unique_ptr<stored> value;
+   std::exception_ptr error;
+   std::vector<std::function<void()>> waiting;
+};
+
+template <typename R> struct fulfill;
+
+// The parts of future<T> that do not depend on the value.
+template <typename T>
+class futureBase {
+public:
+   typedef T value_type;
+
+   bool isReady() const {
+      std::lock_guard<std::mutex> guard(state->lock);
+      return state->ready;
+   }
+
+   // __onComplete(func)__.
+   // Calls func() on the pool once the future has a value or an error.
+   void onComplete(const std::function<void()>& func) const {
+      state->onReady(func);
+   }
+
+   // __error()__.
+   // Returns the error of a completed future, or null if it succeeded.
+   std::exception_ptr error() const {
+      std::lock_guard<std::mutex> guard(state->lock);
+      return state->error;
+   }
+
+protected:
+   explicit futureBase(const std::shared_ptr<futureState<T>>& state) : state(state) {}
+   std::shared_ptr<futureState<T>> state;
+};
+
+// The parts of promise<T> that do not depend on the value.
+template <typename T>
+class promiseBase {
+public:
+   promiseBase() : state(std::make_shared<futureState<T>>()) {}
+
+   future<T> getFuture() const {
+      return future<T>(state);
+   }
+
+   // __fail(error)__.
+   // Completes the future with an error.
+   void fail(std::exception_ptr error) const {
+      state->complete(std::unique_ptr<typename futureState<T>::stored>(), error);
+   }
+
+protected:
+   std::shared_ptr<futureState<T>> state;
+};
+
+} // namespace sanity_detail
+
+template <typename T>
+class future : public sanity_detail::futureBase<T> {
+public:
+   // __get()__.
+   // Waits for the value and returns it, or rethrows the computation's error.
+   // Avoid calling get() from a task on the pool; use then() instead.
+   const T& get() const {
+      return this->state->get();
+   }
+
+   // __then(func)__.
+   // Returns a future of func(value), computed on the pool once this
+   // future's value is ready.
+   template <typename F>
+   auto then(const F& func) const -> future<decltype(func(std::declval<const T&>()))> {
+      typedef decltype(func(std::declval<const T&>())) R;
+      promise<R> result;
+      std::shared_ptr<sanity_detail::futureState<T>> s = this->state;
+      this->state->onReady([s, result, func]() {
+         if (s->error) {
+            result.fail(s->error);
+            return;
+         }
+         sanity_detail::fulfill<R>::call(result, [&s, &func]() -> R { return func(*s->value); });
+      });
+      return result.getFuture();
+   }
+
+private:
+   friend class sanity_detail::promiseBase<T>;
+   explicit future(const std::shared_ptr<sanity_detail::futureState<T>>& state) : sanity_detail::futureBase<T>(state) {}
+};
+
+// A future that completes without a value.
+template <>
+class future<void> : public sanity_detail::futureBase<void> {
+public:
+   // __get()__.
+   // Waits for completion, or rethrows the computation's error.
+   void get() const {
+      state->get();
+   }
+
+   // __then(func)__.
+   // Returns a future of func(), computed on the pool once this future completes.
+   template <typename F>
+   auto then(const F& func) const -> future<decltype(func())> {
+      typedef decltype(func()) R;
+      promise<R> result;
+      std::shared_ptr<sanity_detail::futureState<void>> s = state;
+      state->onReady([s, result, func]() {
+         if (s->error) {
+            result.fail(s->error);
+            return;
+         }
+         sanity_detail::fulfill<R>::call(result, func);
+      });
+      return result.getFuture();
+   }
+
+private:
+   friend class sanity_detail::promiseBase<void>;
+   explicit future(const std::shared_ptr<sanity_detail::futureState<void>>& state) : sanity_detail::futureBase<void>(state) {}
+};
+
+// The writing side of a future. Copies refer to the same future.
+template <typename T>
+class promise : public sanity_detail::promiseBase<T> {
+public:
+   // __set(val)__.
+   // Completes the future with val and schedules its continuations.
+   void set(const T& val) const {
+      this->state->complete(std::unique_ptr<T>(new T(val)), std::exception_ptr());
+   }
+};
+
+template <>
+class promise<void> : public sanity_detail::promiseBase<void> {
+public:
+   // __set()__.
+   // Completes the future and schedules its continuations.
+   void set() const {
+      state->complete(std::unique_ptr<bool>(new bool(true)), std::exception_ptr());
+   }
+};
+
+namespace sanity_detail {
+
+// Completes result with func(), or with the error func throws.
+template <typename R>
+struct fulfill {
+   template <typename F>
+   static void call(const promise<R>& result, const F& func) {
+      try {
+         result.set(func());
+      } catch (...) {
+         result.fail(std::current_exception());
+      }
+   }
+};
+
+template <>
+struct fulfill<void> {
+   template <typename F>
+   static void call(const promise<void>& result, const F& func) {
+      try {
+         func();
+      } catch (...) {
+         result.fail(std::current_exception());
+         return;
+      }
+      result.set();
+   }
+};
+
+} // namespace sanity_detail
+
+// __futureCall(func)__.
+// Runs func() on threadPool::shared() and returns a future of its result.
+template <typename F>
+auto futureCall(const F& func) -> future<decltype(func())> {
+   promise<decltype(func())> result;
+   threadPool::shared().submit([result, func]() {
+      sanity_detail::fulfill<decltype(func())>::call(result, func);
+   });
+   return result.getFuture();
+}
+
+// __delayed<T>__.
+// A value computed by calling a function the first time it is needed,
+// on the thread that first needs it. Copies share the computed value.
+template <typename T>
+class delayed {
+public:
+   explicit delayed(const std::function<T()>& func) : state(std::make_shared<delayState>(func)) {}
+
+   const T& get() const {
+      std::call_once(state->once, [this]() { state->value.reset(new T(state->func())); });
+      return *state->value;
+   }
+
+private:
+   struct delayState {
+      explicit delayState(const std::function<T()>& func) : func(func) {}
+      std::function<T()> func;
+      std::once_flag once;
+      std::unique_ptr<T> value;
+   };
+   std::shared_ptr<delayState> state;
+};
+
+// __delay(func)__.
+// Returns a delayed value of func().
+template <typename F>
+auto delay(const F& func) -> delayed<decltype(func())> {
+   return delayed<decltype(func())>(func);
+}
+
+// __whenAll(futures)__.
+// Returns a future of the vector of all the futures' values, in order.
+// It fails with the first error among them.
+template <typename T>
+future<std::vector<T>> whenAll(const std::vector<future<T>>& futures) {
+   promise<std::vector<T>> result;
+   if (futures.empty()) {
+      result.set(std::vector<T>());
+      return result.getFuture();
+   }
+   auto all = std::make_shared<const std::vector<future<T>>>(futures);
+   auto remaining = std::make_shared<std::atomic<size_t>>(futures.size());
+   auto failed = std::make_shared<std::atomic<bool>>(false);
+   for (const auto& f : futures) {
+      f.onComplete([f, all, remaining, failed, result]() {
+         if (f.error()) {
+            if (!failed->exchange(true)) {
+               result.fail(f.error());
+            }
+         } else if (--*remaining == 0) {
+            std::vector<T> values;
+            values.reserve(all->size());
+            for (const auto& done : *all) {
+               values.push_back(done.get());
+            }
+            result.set(values);
+         }
+      });
+   }
+   return result.getFuture();
+}
+
+namespace sanity_detail {
+
+// Maps chunks of coll on the pool, calling checkpoint() before each chunk.
+template <typename C, typename F, typename CHECK>
+auto pmapChunks(const C& coll, const F& func, const CHECK& checkpoint) -> future<std::vector<decltype(func(*coll.begin()))>> {
+   typedef decltype(func(*coll.begin())) R;
+   auto elems = std::make_shared<const std::vector<typename C::value_type>>(coll.begin(), coll.end());
+   size_t n = elems->size();
+   size_t chunk = std::max<size_t>(1, n / (4 * threadPool::shared().size()));
+   std::vector<future<std::vector<R>>> chunks;
+   for (size_t begin = 0; begin < n; begin += chunk) {
+      size_t end = std::min(n, begin + chunk);
+      chunks.push_back(futureCall([elems, func, checkpoint, begin, end]() {
+         checkpoint();
+         std::vector<R> result;
+         result.reserve(end - begin);
+         for (size_t i = begin; i < end; ++i) {
+            result.push_back(func((*elems)[i]));
+         }
+         return result;
+      }));
+   }
+   return whenAll(chunks).then([n](const std::vector<std::vector<R>>& parts) {
+      std::vector<R> result;
+      result.reserve(n);
+      for (const auto& part : parts) {
+         result.insert(result.end(), part.begin(), part.end());
+      }
+      return result;
+   });
+}
+
+} // namespace sanity_detail
+
+// __pmapAsync(coll, func)__.
+// Like map, but applies func to chunks of coll in parallel on
+// threadPool::shared(), returning a future of the results in order.
+template <typename C, typename F>
+auto pmapAsync(const C& coll, const F& func) -> future<std::vector<decltype(func(*coll.begin()))>> {
+   return sanity_detail::pmapChunks(coll, func, sanity_detail::noCheckpoint());
+}
+
+// ## Cancellable parallel operations.
+//
+// These split their work into chunks across threads and check a
+// cancellationToken between chunks, throwing operationCancelled when it fires.
+
+namespace sanity_detail {
+
+// Elements processed between two checks of a cancellationToken.
+const size_t cancellationChunk = 4096;
+
+// Runs func(begin, end) over [0, n) on nthreads threads, in chunks that
+// start at multiples of cancellationChunk, checking token before each.
+template <typename F>
+void cancellableChunks(size_t n, unsigned nthreads, const cancellationToken& token, const F& func) {
+   size_t chunks = (n + cancellationChunk - 1) / cancellationChunk;
+   parallelChunks(chunks, nthreads, [&](size_t from, size_t to) {
+      for (size_t chunk = from; chunk < to; ++chunk) {
+         token.throwIfCancelled();
+         func(chunk * cancellationChunk, std::min(n, (chunk + 1) * cancellationChunk));
+      }
+   });
+}
+
+} // namespace sanity_detail
+
+// __sort(coll, comparisonFunction, token)__.
+// Sorts the coll in parallel using comparisonFunction, least to greatest.
+template <typename C, typename F>
+C sort(const C& coll, const F& comparisonFunction, const cancellationToken& token) {
+   std::vector<typename C::value_type> sorted(coll.begin(), coll.end());
+   sanity_detail::parallelStableSort(sorted, comparisonFunction, std::thread::hardware_concurrency(), token);
+   return C(sorted.begin(), sorted.end());
+}
+
+// __sort(coll, token)__.
+// Sorts the coll in parallel, least to greatest.
+template <typename C>
+C sort(const C& coll, const cancellationToken& token) {
+   return sort(coll, std::less<typename C::value_type>(), token);
+}
+
+// __map(coll, func, token, nthreads)__.
+// Like map(coll, func), with func applied to chunks of coll on nthreads threads.
+template <template <typename, typename> class C, typename A, typename B, typename F>
+auto map(const C<A, B>& coll, const F& func, const cancellationToken& token,
+         unsigned nthreads = std::thread::hardware_concurrency())
+      -> C<decltype(func(first(coll))), std::allocator<decltype(func(first(coll)))> > {
+   typedef decltype(func(first(coll))) elem;
+   std::vector<std::vector<elem>> parts((coll.size() + sanity_detail::cancellationChunk - 1) / sanity_detail::cancellationChunk);
+   sanity_detail::cancellableChunks(coll.size(), nthreads, token, [&](size_t begin, size_t end) {
+      std::vector<elem>& part = parts[begin / sanity_detail::cancellationChunk];
+      part.reserve(end - begin);
+      for (auto iter = coll.begin() + begin; iter != coll.begin() + end; ++iter) {
+         part.push_back(func(*iter));
+      }
+   });
+   C<elem, std::allocator<elem>> result;
+   for (auto& part : parts) {
+      result.insert(result.end(), part.begin(), part.end());
+   }
+   return result;
+}
+
+// __filter(coll, predicate, token, nthreads)__.
+// Like filter(coll, predicate), with predicate applied to chunks of coll on nthreads threads.
+template <typename C, typename F>
+C filter(const C& coll, const F& predicate, const cancellationToken& token,
+         unsigned nthreads = std::thread::hardware_concurrency()) {
+   std::vector<C> parts((coll.size() + sanity_detail::cancellationChunk - 1) / sanity_detail::cancellationChunk);
+   sanity_detail::cancellableChunks(coll.size(), nthreads, token, [&](size_t begin, size_t end) {
+      C& part = parts[begin / sanity_detail::cancellationChunk];
+      for (auto iter = coll.begin() + begin; iter != coll.begin() + end; ++iter) {
+         if (predicate(*iter)) {
+            part.push_back(*iter);
+         }
+      }
+   });
+   C result;
+   for (auto& part : parts) {
+      result.insert(result.end(), part.begin(), part.end());
+   }
+   return result;
+}
+
+// __pmapAsync(coll, func, token)__.
+// Like pmapAsync(coll, func); each chunk checks token before it starts,
+// and the future fails with operationCancelled once it fires.
+template <typename C, typename F>
+auto pmapAsync(const C& coll, const F& func, const cancellationToken& token) -> future<std::vector<decltype(func(*coll.begin()))>> {
+   return sanity_detail::pmapChunks(coll, func, token);
+}
+
+// __memoize(func, capacity, ttl)__.
+// Returns a function object caching the results of the pure function
+// func by argument. The cache is split into shards, each with its own
+// lock and least-recently-used eviction, so parallel map workers rarely
+// contend. Entries older than ttl are recomputed (zero means never).
+// Copies of the memoized function share the cache.
+//
+// `auto slowSquare = memoize(square, 10000); map(coll, slowSquare);`
+
+namespace sanity_detail {
+
+template <typename TUPLE, size_t I = std::tuple_size<TUPLE>::value>
+struct tupleHasher {
+   static void hash(const TUPLE& t, size_t& seed) {
+      tupleHasher<TUPLE, I - 1>::hash(t, seed);
+      hashCombine(seed, std::hash<typename std::decay<typename std::tuple_element<I - 1, TUPLE>::type>::type>()(std::get<I - 1>(t)));
+   }
+};
+
+template <typename TUPLE>
+struct tupleHasher<TUPLE, 0> {
+   static void hash(const TUPLE&, size_t&) {}
+};
+
+struct tupleHash {
+   template <typename TUPLE>
+   size_t operator()(const TUPLE& t) const {
+      size_t seed = 0;
+      tupleHasher<TUPLE>::hash(t, seed);
+      return seed;
+   }
+};
+
+// The signature of a function pointer or of a function object's operator().
+template <typename F>
+struct functionTraits : functionTraits<decltype(&F::operator())> {};
+
+template <typename R, typename... ARGS>
+struct functionTraits<R (*)(ARGS...)> {
+   typedef std::function<R(ARGS...)> function;
+};
+
+template <typename R, typename... ARGS>
+struct functionTraits<R(ARGS...)> : functionTraits<R (*)(ARGS...)> {};
+
+template <typename C, typename R, typename... ARGS>
+struct functionTraits<R (C::*)(ARGS...) const> : functionTraits<R (*)(ARGS...)> {};
+
+template <typename C, typename R, typename... ARGS>
+struct functionTraits<R (C::*)(ARGS...)> : functionTraits<R (*)(ARGS...)> {};
+
+} // namespace sanity_detail
+
+template <typename R, typename... ARGS>
+class memoized;
+
+template <typename R, typename... ARGS>
+class memoized<R(ARGS...)> {
+public:
+   typedef std::tuple<typename std::decay<ARGS>::type...> key;
+   typedef std::chrono::steady_clock clock;
+
+   memoized(const std::function<R(ARGS...)>& func, size_t capacity, clock::duration ttl, unsigned shardCount)
+      : state(std::make_shared<cache>(func, capacity, ttl, shardCount)) {}
+
+   R operator()(const typename std::decay<ARGS>::type&... args) const {
+      key k(args...);
+      shard& s = state->shards[sanity_detail::tupleHash()(k) % state->shards.size()];
+      clock::time_point now = state->ttl.count() > 0 ? clock::now() : clock::time_point();
+      {
+         std::lock_guard<std::mutex> guard(s.lock);
+         auto found = s.index.find(k);
+         if (found != s.index.end()) {
+            if (state->ttl.count() == 0 || now - found->second->stored < state->ttl) {
+               // Move to the front of the recency list.
+               s.entries.splice(s.entries.begin(), s.entries, found->second);
+               ++s.hits;
+               return found->second->val;
+            }
+            s.entries.erase(found->second);
+            s.index.erase(found);
+         }
+         ++s.misses;
+      }
+      // Computed outside the lock so a slow func doesn't stall the shard.
+      R val = state->func(args...);
+      std::lock_guard<std::mutex> guard(s.lock);
+      auto found = s.index.find(k);
+      if (found != s.index.end()) {
+         s.entries.erase(found->second);
+         s.index.erase(found);
+      }
+      s.entries.push_front(entry(k, val, now));
+      s.index[k] = s.entries.begin();
+      if (s.entries.size() > state->shardCapacity) {
+         s.index.erase(s.entries.back().k);
+         s.entries.pop_back();
+      }
+      return val;
+   }
+
+   size_t hits() const { return sum(&shard::hits); }
+   size_t misses() const { return sum(&shard::misses); }
+
+   // Returns the number of cached results.
+   size_t size() const {
+      size_t result = 0;
+      for (auto& s : state->shards) {
+         std::lock_guard<std::mutex> guard(s.lock);
+         result += s.entries.size();
+      }
+      return result;
+   }
+
+   void clear() const {
+      for (auto& s : state->shards) {
+         std::lock_guard<std::mutex> guard(s.lock);
+         s.entries.clear();
+         s.index.clear();
+      }
+   }
+
+private:
+   struct shard;
+
+   // Adds up a counter kept by each shard.
+   size_t sum(size_t shard::*counter) const {
+      size_t result = 0;
+      for (auto& s : state->shards) {
+         std::lock_guard<std::mutex> guard(s.lock);
+         result += s.*counter;
+      }
+      return result;
+   }
+
+   struct entry {
+      entry(const key& k, const R& val, clock::time_point stored) : k(k), val(val), stored(stored) {}
+      key k;
+      R val;
+      clock::time_point stored;
+   };
+
+   // Hit and miss counts live in the shards, under their locks, so
+   // lookups in different shards share no counters.
+   struct shard {
+      shard() : hits(0), misses(0) {}
+      mutable std::mutex lock;
+      size_t hits;
+      size_t misses;
+      std::list<entry> entries;
+      std::unordered_map<key, typename std::list<entry>::iterator, sanity_detail::tupleHash> index;
+   };
+
+   struct cache {
+      cache(const std::function<R(ARGS...)>& func, size_t capacity, clock::duration ttl, unsigned shardCount)
+         : func(func), shards(std::max(1u, shardCount)), shardCapacity(std::max<size_t>(1, capacity / shards.size())),
+           ttl(ttl) {}
+      std::function<R(ARGS...)> func;
+      std::vector<shard> shards;
+      size_t shardCapacity;
+      clock::duration ttl;
+   };
+
+   std::shared_ptr<cache> state;
+};
+
+namespace sanity_detail {
+
+template <typename FUNCTION>
+struct memoizedOf;
+
+template <typename R, typename... ARGS>
+struct memoizedOf<std::function<R(ARGS...)>> {
+   typedef memoized<R(ARGS...)> type;
+};
+
+} // namespace sanity_detail
+
+template <typename F>
+auto memoize(const F& func, size_t capacity = 100000, std::chrono::steady_clock::duration ttl = std::chrono::steady_clock::duration::zero(),
+             unsigned shards = 16) -> typename sanity_detail::memoizedOf<typename sanity_detail::functionTraits<F>::function>::type {
+   typedef typename sanity_detail::memoizedOf<typename sanity_detail::functionTraits<F>::function>::type M;
+   return M(func, capacity, ttl, shards);
+}
+
+// ## Hash consing.
+
+// __interner<T, H>__.
+// An opt-in hash-consing table. intern(val) returns a pointer to the one
+// canonical value equal to val, so equal values share one representation
+// and compare equal by pointer. The table holds only weak references:
+// a canonical value is freed once nobody else holds it, and its entry is
+// swept on a later intern. Copies of an interner share the table.
+//
+// `interner<pvector<int>> fragments; auto a = fragments.intern(v1), b = fragments.intern(v2); a == b`
+template <typename T, typename H = std::hash<T>>
+class interner {
+public:
+   explicit interner(unsigned shards = 16) : state(std::make_shared<table>(std::max(1u, shards))) {}
+
+   std::shared_ptr<const T> intern(const T& val) const {
+      size_t hash = H()(val);
+      shard& s = state->shards[hash % state->shards.size()];
+      std::lock_guard<std::mutex> guard(s.lock);
+      auto range = s.entries.equal_range(hash);
+      for (auto iter = range.first; iter != range.second;) {
+         std::shared_ptr<const T> canonical = iter->second.lock();
+         if (!canonical) {
+            iter = s.entries.erase(iter);
+         } else if (*canonical == val) {
+            return canonical;
+         } else {
+            ++iter;
+         }
+      }
+      // Not make_shared: the weak reference left in the table would keep
+      // the value's storage alive along with the control block.
+      std::shared_ptr<const T> canonical(new T(val));
+      s.entries.insert(std::make_pair(hash, std::weak_ptr<const T>(canonical)));
+      if (s.entries.size() >= 2 * s.sweptSize) {
+         sweep(s);
+      }
+      return canonical;
+   }
+
+   // The number of entries, including any not yet swept.
+   size_t size() const {
+      size_t result = 0;
+      for (auto& s : state->shards) {
+         std::lock_guard<std::mutex> guard(s.lock);
+         result += s.entries.size();
+      }
+      return result;
+   }
+
+   // Removes the entries of every value that has been freed.
+   void purge() const {
+      for (auto& s : state->shards) {
+         std::lock_guard<std::mutex> guard(s.lock);
+         sweep(s);
+      }
+   }
+
+   // A process-wide interner for T.
+   static interner& shared() {
+      static interner table;
+      return table;
+   }
+
+private:
+   struct shard {
+      shard() : sweptSize(64) {}
+      mutable std::mutex lock;
+      std::unordered_multimap<size_t, std::weak_ptr<const T>> entries;
+      size_t sweptSize;
+   };
+
+   struct table {
+      explicit table(unsigned shardCount) : shards(shardCount) {}
+      std::vector<shard> shards;
+   };
+
+   static void sweep(shard& s) {
+      for (auto iter = s.entries.begin(); iter != s.entries.end();) {
+         iter = iter->second.expired() ? s.entries.erase(iter) : std::next(iter);
+      }
+      s.sweptSize = std::max<size_t>(64, s.entries.size());
+   }
+
+   std::shared_ptr<table> state;
+};
+
+// __hashCons(val)__.
+// Interns val in interner<T>::shared().
+template <typename T>
+std::shared_ptr<const T> hashCons(const T& val) {
+   return interner<T>::shared().intern(val);
+}
+
+// ## Numerical functions.
+
+// __isEven(x)__.
+// Returns true if x is even.
+template <typename A>
+bool isEven(A x) {
+   return x % 2 == 0;
+}
+
+// __isOdd(x)__.
+// Returns true if x is odd.
+template <typename A>
+bool isOdd(A x) {
+   return !isEven(x);
+}
+
+// __isZero(x)__.
+// Returns true if x is zero.
+template <typename A>
+bool isZero(A x) {
+   return x == 0;
+}
+
+// __isPositive(x)__.
+// Returns true if x is more than zero.
+template <typename A>
+bool isPositive(A x) {
+   return x > 0;
+}
+
+// __isNegative(x)__.
+// Returns true if x is less than zero.
+template <typename A>
+bool isNegative(A x) {
+   return x < 0;
+}
+
+// __inc(x)__.
+// Increases x by 1.
+template <typename A>
+A inc(A x) {
+   return x + 1;
+}
+
+// __dec(x)__.
+// Decreases x by 1.
+template <typename A>
+A dec(A x) {
+   return x - 1;
+}
+
+// __add(a, b)__.
+// Returns a + b.
+template <typename A, typename B>
+auto add(A a, B b) -> decltype(a + b) {
+   return a + b;
+}
+
+// __subtract(a, b)__.
+// Returns a - b.
+template <typename A, typename B>
+auto subtract(A a, B b) -> decltype(a - b) {
+   return a - b;
+}
+
+// __multiply(a, b)__.
+// Returns a * b.
+template <typename A, typename B>
+auto multiply(A a, B b) -> decltype(a * b) {
+   return a * b;
+}
+
+// __divide(a, b)__.
+// Returns a / b.
+template <typename A, typename B>
+auto divide(A a, B b) -> decltype(a / b) {
+   return a / b;
+}
+
+// __modulo(a, b)__.
+// Returns a % b.
+template <typename A, typename B>
+auto modulo(A a, B b) -> decltype(a % b) {
+   return a % b;
+}
+
+// ## Strings
+
+// __split<S>(input, regex)__.
+// Split into tokens separated by regex, each converted to S.
+//
+// `split<keyword>("id,name", ",") => [:id, :name]`
+template <typename S = std::string>
+std::vector<S> split(const std::string& input, const std::string& regex) {
+   std::vector<S> result;
+   std::regex separator(regex);
+   std::sregex_token_iterator iter(input.begin(), input.end(), separator, -1);
+   std::sregex_token_iterator end;
+   for (; iter != end; ++iter) {
+      result.push_back(S(iter->str()));
+   }
+   return result;
+}
+
+// ## I/O
+
+// __spit(file, content)__.
+// Write a string to a file.
+inline void spit(const std::string& file, const std::string& content) {
+   std::ofstream out(file);
+   out << content;
+   out.close();
+}
+
+// __slurp(file)__.
+// Read a file into a string.
+inline std::string slurp(const std::string& file) {
+   std::ifstream input(file);
+   std::stringstream buffer;
+   buffer << input.rdbuf();
+   return buffer.str();
+}
+
+// ## Binary records.
+
+namespace sanity_detail {
+
+// Buffered binary output. Trivially copyable values are written as their
+// bytes, strings as a 64-bit length followed by their chars, and pairs as
+// their two members in turn.
+class binaryWriter {
+public:
+   // mode adds to binary output: trunc to start over, app to append, or
+   // in to update an existing file in place.
+   binaryWriter(const std::string& path, size_t bufferSize, std::ios::openmode mode = std::ios::trunc)
+      : out(path, std::ios::binary | mode), capacity(std::max<size_t>(bufferSize, 4096)) {
+      if (!out) {
+         throw std::runtime_error("cannot open " + path + " for writing");
+      }
+      buffer.reserve(capacity);
+   }
+   ~binaryWriter() {
+      try {
+         flush();
+      } catch (...) {
+      }
+   }
+
+   void writeBytes(const void* data, size_t n) {
+      if (buffer.size() + n > capacity) {
+         flush();
+      }
+      if (n >= capacity) {
+         out.write(static_cast<const char*>(data), n);
+      } else {
+         buffer.insert(buffer.end(), static_cast<const char*>(data), static_cast<const char*>(data) + n);
+      }
+   }
+
+   void flush() {
+      if (!buffer.empty()) {
+         out.write(buffer.data(), buffer.size());
+         buffer.clear();
+      }
+      out.flush();
+      if (!out) {
+         throw std::runtime_error("write failed");
+      }
+   }
+
+   // Continues writing at offset.
+   void seek(size_t offset) {
+      flush();
+      out.seekp((std::streamoff) offset);
+      if (!out) {
+         throw std::runtime_error("seek failed");
+      }
+   }
+
+private:
+   std::ofstream out;
+   std::vector<char> buffer;
+   size_t capacity;
+};
+
+// Buffered binary input in the format of binaryWriter.
+class binaryReader {
+public:
+   binaryReader(const std::string& path, size_t bufferSize)
+      : in(path, std::ios::binary), buffer(std::max<size_t>(bufferSize, 4096)), pos(0), end(0) {
+      if (!in) {
+         throw std::runtime_error("cannot open " + path + " for reading");
+      }
+   }
+
+   // Reads n bytes. Returns false if the input ended first; a record
+   // cut off in the middle is an error.
+   bool readBytes(void* data, size_t n, bool startOfRecord) {
+      char* dest = static_cast<char*>(data);
+      size_t copied = 0;
+      while (copied < n) {
+         if (pos == end && !refill()) {
+            if (copied == 0 && startOfRecord) {
+               return false;
+            }
+            throw std::runtime_error("truncated record");
+         }
+         size_t chunk = std::min(n - copied, end - pos);
+         std::copy(buffer.begin() + pos, buffer.begin() + pos + chunk, dest + copied);
+         pos += chunk;
+         copied += chunk;
+      }
+      return true;
+   }
+
+private:
+   bool refill() {
+      in.read(buffer.data(), buffer.size());
+      pos = 0;
+      end = (size_t) in.gcount();
+      return end > 0;
+   }
+
+   std::ifstream in;
+   std::vector<char> buffer;
+   size_t pos;
+   size_t end;
+};
+
+// Appends binary records to a string.
+struct bytesWriter {
+   void writeBytes(const void* data, size_t n) { bytes.append(static_cast<const char*>(data), n); }
+   std::string bytes;
+};
+
+// Reads binary records from a block of memory.
+class bytesReader {
+public:
+   bytesReader(const char* data, size_t size) : data(data), size(size), pos(0) {}
+
+   bool readBytes(void* dest, size_t n, bool startOfRecord) {
+      if (pos == size && startOfRecord && n > 0) {
+         return false;
+      }
+      if (n > size - pos) {
+         throw std::runtime_error("truncated record");
+      }
+      std::copy(data + pos, data + pos + n, static_cast<char*>(dest));
+      pos += n;
+      return true;
+   }
+
+private:
+   const char* data;
+   size_t size;
+   size_t pos;
+};
+
+template <typename W, typename T>
+void writeRecord(W& out, const T& val) {
+   static_assert(std::is_trivially_copyable<T>::value, "records must be trivially copyable, strings or pairs");
+   out.writeBytes(&val, sizeof(T));
+}
+
+template <typename W>
+void writeRecord(W& out, const std::string& val) {
+   uint64_t n = val.size();
+   out.writeBytes(&n, sizeof(n));
+   out.writeBytes(val.data(), val.size());
+}
+
+template <typename W, typename A, typename B>
+void writeRecord(W& out, const std::pair<A, B>& val) {
+   writeRecord(out, val.first);
+   writeRecord(out, val.second);
+}
+
+template <typename R, typename T>
+bool readRecord(R& in, T& val, bool startOfRecord = true) {
+   static_assert(std::is_trivially_copyable<T>::value, "records must be trivially copyable, strings or pairs");
+   return in.readBytes(&val, sizeof(T), startOfRecord);
+}
+
+template <typename R>
+bool readRecord(R& in, std::string& val, bool startOfRecord = true) {
+   uint64_t n = 0;
+   if (!in.readBytes(&n, sizeof(n), startOfRecord)) {
+      return false;
+   }
+   val.resize((size_t) n);
+   return n == 0 || in.readBytes(&val[0], (size_t) n, false);
+}
+
+template <typename R, typename A, typename B>
+bool readRecord(R& in, std::pair<A, B>& val, bool startOfRecord = true) {
+   return readRecord(in, val.first, startOfRecord) && readRecord(in, val.second, false);
+}
+
+// The memory a record takes up, for budgeting.
+template <typename T>
+size_t recordBytes(const T&) {
+   return sizeof(T);
+}
+
+inline size_t recordBytes(const std::string& val) {
+   return sizeof(std::string) + val.capacity();
+}
+
+template <typename A, typename B>
+size_t recordBytes(const std::pair<A, B>& val) {
+   return recordBytes(val.first) + recordBytes(val.second) + sizeof(val) - sizeof(A) - sizeof(B);
+}
+
+const size_t recordBufferSize = 1 << 20;
+
+} // namespace sanity_detail
+
+// __recordFile<T>__.
+// A file of T records in the library's binary format, read as a sequence.
+// Records are trivially copyable values, strings or pairs of records.
+//
+// `for (const auto& val : recordFile<double>("values.bin")) { ... }`
+template <typename T>
+class recordFile {
+public:
+   typedef T value_type;
+
+   class const_iterator {
+   public:
+      typedef std::input_iterator_tag iterator_category;
+      typedef T value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef const T* pointer;
+      typedef const T& reference;
+
+      const_iterator() {}
+      explicit const_iterator(const std::string& path)
+         : reader(std::make_shared<sanity_detail::binaryReader>(path, sanity_detail::recordBufferSize)) {
+         ++*this;
+      }
+
+      reference operator*() const { return val; }
+      pointer operator->() const { return &val; }
+      const_iterator& operator++() {
+         if (!sanity_detail::readRecord(*reader, val)) {
+            reader.reset();
+         }
+         return *this;
+      }
+      bool operator==(const const_iterator& other) const { return reader == other.reader; }
+      bool operator!=(const const_iterator& other) const { return reader != other.reader; }
+
+   private:
+      std::shared_ptr<sanity_detail::binaryReader> reader;
+      T val;
+   };
+   typedef const_iterator iterator;
+
+   explicit recordFile(const std::string& path) : path(path) {}
+
+   const_iterator begin() const { return const_iterator(path); }
+   const_iterator end() const { return const_iterator(); }
+
+private:
+   std::string path;
+};
+
+// __spitRecords(file, coll)__.
+// Writes the items of coll to file in the binary record format.
+template <typename C>
+void spitRecords(const std::string& file, const C& coll) {
+   sanity_detail::binaryWriter out(file, sanity_detail::recordBufferSize);
+   for (const auto& val : coll) {
+      sanity_detail::writeRecord(out, val);
+   }
+   out.flush();
+}
+
+// ## External sorting.
+
+namespace sanity_detail {
+
+// Merges the sorted run files into path, breaking ties by run order so the
+// sort stays stable. Each run gets an equal share of bufferBytes.
+template <typename T, typename F>
+void mergeRuns(const std::vector<std::string>& runs, const std::string& path, size_t bufferBytes, const F& comparisonFunction,
+               const cancellationToken& token) {
+   size_t share = std::max<size_t>(bufferBytes / (runs.size() + 1), 64 * 1024);
+   std::vector<std::unique_ptr<binaryReader>> readers;
+   std::vector<T> heads(runs.size());
+   typedef std::pair<size_t, size_t> item;
+   // A min-heap on (head value, run index).
+   auto later = [&](const item& a, const item& b) {
+      if (comparisonFunction(heads[b.first], heads[a.first])) {
+         return true;
+      }
+      return !comparisonFunction(heads[a.first], heads[b.first]) && b.first < a.first;
+   };
+   std::vector<item> heap;
+   for (size_t i = 0; i < runs.size(); ++i) {
+      readers.emplace_back(new binaryReader(runs[i], share));
+      if (readRecord(*readers[i], heads[i])) {
+         heap.push_back(item(i, 0));
+      }
+   }
+   std::make_heap(heap.begin(), heap.end(), later);
+   binaryWriter out(path, share);
+   for (size_t count = 0; !heap.empty(); ++count) {
+      if (count % cancellationChunk == 0) {
+         token.throwIfCancelled();
+      }
+      std::pop_heap(heap.begin(), heap.end(), later);
+      size_t run = heap.back().first;
+      writeRecord(out, heads[run]);
+      if (readRecord(*readers[run], heads[run])) {
+         std::push_heap(heap.begin(), heap.end(), later);
+      } else {
+         heap.pop_back();
+      }
+   }
+   out.flush();
+}
+
+} // namespace sanity_detail
+
+// __externalSort(input, outputPath, memoryBudget, comparisonFunction, token)__.
+// Sorts a sequence too large for memory into outputPath, in the binary
+// record format. Runs of up to memoryBudget bytes are sorted in parallel
+// and spilled to temporary files next to outputPath, then merged k ways
+// with large sequential buffers, in several passes if there are too many
+// runs to merge at once. The budget covers the records, the run's spare
+// vector capacity and the sort's scratch buffer, which is at most one
+// slot per record; a run that is growing briefly also holds its old
+// storage. input may be any sequence, including a recordFile. The sort is
+// stable. Returns the number of records; temporary files are removed even
+// if the sort fails or token is cancelled.
+//
+// `externalSort(recordFile<long>("in.bin"), "out.bin", 1 << 30)`
+template <typename C, typename F>
+size_t externalSort(const C& input, const std::string& outputPath, size_t memoryBudget, const F& comparisonFunction,
+                    const cancellationToken& token) {
+   typedef typename C::value_type T;
+   size_t budget = std::max<size_t>(memoryBudget, 1 << 20);
+   unsigned nthreads = std::max(1u, std::thread::hardware_concurrency());
+   std::vector<std::string> runs;
+   std::vector<std::string> temporary;
+   size_t count = 0;
+   auto checkpoint = [&token]() { token.throwIfCancelled(); };
+   try {
+      std::vector<T> run;
+      size_t runBytes = 0;
+      auto spill = [&]() {
+         sanity_detail::parallelStableSort(run, comparisonFunction, nthreads, checkpoint);
+         std::string path = outputPath + ".run" + std::to_string(temporary.size());
+         temporary.push_back(path);
+         runs.push_back(path);
+         spitRecords(path, run);
+         std::vector<T>().swap(run);
+         runBytes = 0;
+      };
+      for (const auto& val : input) {
+         if (count++ % sanity_detail::cancellationChunk == 0) {
+            token.throwIfCancelled();
+         }
+         runBytes += sanity_detail::recordBytes(val);
+         run.push_back(val);
+         // One sizeof(T) per slot covers both spare capacity and the sort
+         // buffer, which never needs more slots than there are records.
+         if (runBytes + run.capacity() * sizeof(T) >= budget) {
+            spill();
+         }
+      }
+      if (runs.empty()) {
+         // Everything fit in memory.
+         sanity_detail::parallelStableSort(run, comparisonFunction, nthreads, checkpoint);
+         spitRecords(outputPath, run);
+         return count;
+      }
+      if (!run.empty()) {
+         spill();
+      }
+      size_t fanIn = std::max<size_t>(2, budget / (1 << 20));
+      while (runs.size() > fanIn) {
+         std::vector<std::string> merged;
+         for (size_t i = 0; i < runs.size(); i += fanIn) {
+            std::vector<std::string> group(runs.begin() + i, runs.begin() + std::min(runs.size(), i + fanIn));
+            std::string path = outputPath + ".run" + std::to_string(temporary.size());
+            temporary.push_back(path);
+            sanity_detail::mergeRuns<T>(group, path, budget, comparisonFunction, token);
+            for (const auto& done : group) {
+               std::remove(done.c_str());
+            }
+            merged.push_back(path);
+         }
+         runs.swap(merged);
+      }
+      sanity_detail::mergeRuns<T>(runs, outputPath, budget, comparisonFunction, token);
+   } catch (...) {
+      for (const auto& path : temporary) {
+         std::remove(path.c_str());
+      }
+      throw;
+   }
+   for (const auto& path : temporary) {
+      std::remove(path.c_str());
+   }
+   return count;
+}
+
+template <typename C, typename F>
+size_t externalSort(const C& input, const std::string& outputPath, size_t memoryBudget, const F& comparisonFunction) {
+   return externalSort(input, outputPath, memoryBudget, comparisonFunction, cancellationToken());
+}
+
+template <typename C>
+size_t externalSort(const C& input, const std::string& outputPath, size_t memoryBudget) {
+   return externalSort(input, outputPath, memoryBudget, std::less<typename C::value_type>(), cancellationToken());
+}
+
+// ## Spilling aggregation.
+
+namespace sanity_detail {
+
+const unsigned spillPartitions = 64;
+
+// Partitions past this depth are aggregated in memory whatever their size,
+// since a single large group cannot be split further.
+const unsigned maxSpillLevel = 4;
+
+// A rough allowance for a hash table entry beyond its key and val.
+const size_t tableEntryBytes = 64;
+
+inline std::string spillPrefix(const std::string& directory) {
+   std::random_device random;
+   return directory + "/sanity-spill-" + std::to_string(random()) + "-" + std::to_string(random()) + "-";
+}
+
+// Aggregates (key, item) pairs in a hash table of at most budget bytes.
+// When the table fills up, its entries are spilled to partition files by
+// key hash and the table starts over; each partition is then aggregated
+// in turn, repartitioning with a different hash if it is still too big.
+// add(acc, item) folds item into acc and returns the bytes it added;
+// spill(out, key, acc) writes acc as (key, item) records.
+template <typename K, typename I, typename A, typename ADD, typename SPILL, typename EMIT>
+class spillingAggregator {
+public:
+   spillingAggregator(size_t budget, const ADD& add, const SPILL& spill, const EMIT& emit, const std::string& directory)
+      : budget(std::max<size_t>(budget, 1 << 16)), add(add), spill(spill), emit(emit), directory(directory) {}
+
+   typedef std::function<void(const K&, const I&)> sink;
+
+   // feed(sink) calls sink(key, item) for every input pair.
+   void run(const std::function<void(const sink&)>& feed, unsigned level) {
+      std::unordered_map<K, A, hashOfFunction> table;
+      size_t bytes = 0;
+      std::vector<std::string> paths;
+      std::vector<std::unique_ptr<binaryWriter>> parts;
+      auto spillTable = [&]() {
+         if (parts.empty()) {
+            std::string prefix = spillPrefix(directory);
+            for (unsigned i = 0; i < spillPartitions; ++i) {
+               paths.push_back(prefix + std::to_string(i));
+               parts.emplace_back(new binaryWriter(paths.back(), budget / (4 * spillPartitions)));
+            }
+         }
+         for (const auto& kv : table) {
+            spill(*parts[partitionOf(kv.first, level)], kv.first, kv.second);
+         }
+         table.clear();
+         bytes = 0;
+      };
+      try {
+         feed([&](const K& key, const I& item) {
+            auto iter = table.find(key);
+            if (iter == table.end()) {
+               iter = table.emplace(key, A()).first;
+               bytes += recordBytes(key) + tableEntryBytes;
+            }
+            bytes += add(iter->second, item);
+            if (bytes >= budget && level < maxSpillLevel) {
+               spillTable();
+            }
+         });
+         if (parts.empty()) {
+            for (const auto& kv : table) {
+               emit(kv.first, kv.second);
+            }
+            return;
+         }
+         spillTable();
+         parts.clear();
+         for (const auto& path : paths) {
+            run([&path](const sink& output) {
+               for (const auto& record : recordFile<std::pair<K, I>>(path)) {
+                  output(record.first, record.second);
+               }
+            }, level + 1);
+            std::remove(path.c_str());
+         }
+      } catch (...) {
+         parts.clear();
+         for (const auto& path : paths) {
+            std::remove(path.c_str());
+         }
+         throw;
+      }
+   }
+
+private:
+   static size_t partitionOf(const K& key, unsigned level) {
+      return mixHash(hashOf(key) + level * 0x9e3779b9u) % spillPartitions;
+   }
+
+   size_t budget;
+   ADD add;
+   SPILL spill;
+   EMIT emit;
+   std::string directory;
+};
+
+template <typename K, typename I, typename A, typename ADD, typename SPILL, typename EMIT>
+spillingAggregator<K, I, A, ADD, SPILL, EMIT> makeSpillingAggregator(size_t budget, const ADD& add, const SPILL& spill,
+                                                                      const EMIT& emit, const std::string& directory) {
+   return spillingAggregator<K, I, A, ADD, SPILL, EMIT>(budget, add, spill, emit, directory);
+}
+
+} // namespace sanity_detail
+
+// __groupBy(coll, func, memoryBudget, emit, directory)__.
+// Groups like groupBy(coll, func), but holds at most about memoryBudget
+// bytes of groups in memory. Past that, partial groups are spilled by key
+// hash to temporary files in directory and regrouped one partition at a
+// time. Calls emit(key, items) once per group, in no particular order;
+// each group keeps its items in input order. Keys and items must be
+// binary records (see recordFile).
+template <typename C, typename F, typename EMIT>
+void groupBy(const C& coll, const F& func, size_t memoryBudget, const EMIT& emit, const std::string& directory = ".") {
+   typedef typename C::value_type T;
+   typedef typename std::decay<decltype(func(first(coll)))>::type K;
+   auto aggregator = sanity_detail::makeSpillingAggregator<K, T, std::vector<T>>(
+      memoryBudget,
+      [](std::vector<T>& items, const T& item) {
+         items.push_back(item);
+         return sanity_detail::recordBytes(item);
+      },
+      [](sanity_detail::binaryWriter& out, const K& key, const std::vector<T>& items) {
+         for (const auto& item : items) {
+            sanity_detail::writeRecord(out, key);
+            sanity_detail::writeRecord(out, item);
+         }
+      },
+      emit, directory);
+   aggregator.run([&coll, &func](const std::function<void(const K&, const T&)>& output) {
+      for (const auto& element : coll) {
+         output(func(element), element);
+      }
+   }, 0);
+}
+
+// __frequencies(coll, memoryBudget, emit, directory)__.
+// Counts like frequencies(coll), spilling partial counts to temporary
+// files in directory once they take more than about memoryBudget bytes.
+// Calls emit(item, count) once per distinct item, in no particular order.
+template <typename C, typename EMIT>
+void frequencies(const C& coll, size_t memoryBudget, const EMIT& emit, const std::string& directory = ".") {
+   typedef typename C::value_type K;
+   auto aggregator = sanity_detail::makeSpillingAggregator<K, long, long>(
+      memoryBudget,
+      [](long& count, long n) {
+         count += n;
+         return (size_t) 0;
+      },
+      [](sanity_detail::binaryWriter& out, const K& key, long count) {
+         sanity_detail::writeRecord(out, key);
+         sanity_detail::writeRecord(out, count);
+      },
+      emit, directory);
+   aggregator.run([&coll](const std::function<void(const K&, const long&)>& output) {
+      for (const auto& element : coll) {
+         output(element, 1L);
+      }
+   }, 0);
+}
+
+// ## Snapshot logs.
+
+namespace sanity_detail {
+
+// A file mapped into memory read-only; read into memory where mmap is
+// unavailable.
+class mappedFile {
+public:
+   explicit mappedFile(const std::string& path) : base(nullptr), length(0) {
+#if defined(__unix__) || defined(__APPLE__)
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0) {
+         throw std::runtime_error("cannot open " + path);
+      }
+      struct stat info;
+      if (fstat(fd, &info) == 0 && info.st_size > 0) {
+         length = (size_t) info.st_size;
+         void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+         if (mapped == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("cannot map " + path);
+         }
+         base = static_cast<const char*>(mapped);
+      }
+      ::close(fd);
+#else
+      std::ifstream in(path, std::ios::binary);
+      if (!in) {
+         throw std::runtime_error("cannot open " + path);
+      }
+      contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+      base = contents.data();
+      length = contents.size();
+#endif
+   }
+
+   ~mappedFile() {
+#if defined(__unix__) || defined(__APPLE__)
+      if (base) {
+         munmap(const_cast<char*>(base), length);
+      }
+#endif
+   }
+
+   const char* data() const { return base; }
+   size_t size() const { return length; }
+
+private:
+   mappedFile(const mappedFile&);
+   mappedFile& operator=(const mappedFile&);
+
+   const char* base;
+   size_t length;
+#if !defined(__unix__) && !defined(__APPLE__)
+   std::vector<char> contents;
+#endif
+};
+
+// Flushes a file, or a directory's entries, to disk. Does nothing where
+// fsync is unavailable.
+inline void syncPath(const std::string& path) {
+#if defined(__unix__) || defined(__APPLE__)
+   int fd = ::open(path.c_str(), O_RDONLY);
+   if (fd < 0 || fsync(fd) != 0) {
+      if (fd >= 0) {
+         ::close(fd);
+      }
+      throw std::runtime_error("cannot sync " + path);
+   }
+   ::close(fd);
+#else
+   (void) path;
+#endif
+}
+
+inline std::string parentDirectory(const std::string& path) {
+   size_t slash = path.find_last_of('/');
+   return slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+}
+
+// Cuts the file at path back to size bytes, in place, and syncs it. Where
+// truncate is unavailable the bytes past size are zeroed instead; no
+// record starts with a zero byte, so a scan stops there.
+inline void truncateFile(const std::string& path, size_t size, size_t oldSize) {
+#if defined(__unix__) || defined(__APPLE__)
+   (void) oldSize;
+   if (::truncate(path.c_str(), (off_t) size) != 0) {
+      throw std::runtime_error("cannot truncate " + path);
+   }
+#else
+   binaryWriter out(path, recordBufferSize, std::ios::in);
+   out.seek(size);
+   std::vector<char> zeros(std::min<size_t>(oldSize - size, recordBufferSize), 0);
+   for (size_t left = oldSize - size; left > 0; left -= std::min(left, zeros.size())) {
+      out.writeBytes(zeros.data(), std::min(left, zeros.size()));
+   }
+   out.flush();
+#endif
+   syncPath(path);
+}
+
+// A 128-bit content hash naming a node in a snapshot log. The null
+// address stands for an empty subtree.
+struct contentAddress {
+   contentAddress() : high(0), low(0) {}
+   bool isNull() const { return high == 0 && low == 0; }
+   bool operator==(const contentAddress& other) const { return high == other.high && low == other.low; }
+   bool operator!=(const contentAddress& other) const { return !(*this == other); }
+   uint64_t high;
+   uint64_t low;
+};
+
+struct contentAddressHash {
+   size_t operator()(const contentAddress& a) const { return (size_t) (a.high ^ a.low); }
+};
+
+inline uint64_t mix64(uint64_t x) {
+   x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+   x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+   return x ^ (x >> 31);
+}
+
+// Different salts give independent addresses for the same bytes, which
+// lets a log give colliding payloads distinct names.
+inline contentAddress addressOf(const std::string& bytes, uint64_t salt = 0) {
+   uint64_t h1 = 0xcbf29ce484222325ull ^ mix64(salt);
+   uint64_t h2 = 0x84222325cbf29ce4ull + salt;
+   for (unsigned char c : bytes) {
+      h1 = (h1 ^ c) * 0x100000001b3ull;
+      h2 = (h2 ^ c) * 0x1000193ull + 0x9e3779b97f4a7c15ull;
+   }
+   contentAddress result;
+   result.high = mix64(h1 ^ bytes.size());
+   result.low = mix64(h2 + result.high);
+   if (result.isNull()) {
+      result.low = 1;
+   }
+   return result;
+}
+
+// How a persistent collection's nodes are stored in a snapshot log.
+template <typename C>
+struct snapshotCodec;
+
+template <typename K, typename V>
+struct snapshotCodec<pmap<K, V>> {
+   typedef typename pmap<K, V>::tree tree;
+   typedef typename tree::node node;
+   typedef typename tree::ptr ptr;
+
+   static ptr rootOf(const pmap<K, V>& coll) { return coll.rootNode(); }
+   static pmap<K, V> fromRoot(const ptr& root) { return pmap<K, V>(root); }
+
+   template <typename F>
+   static void encode(const ptr& n, bytesWriter& out, const F& store) {
+      contentAddress left = store(n->left);
+      contentAddress right = store(n->right);
+      writeRecord(out, n->entry);
+      writeRecord(out, left);
+      writeRecord(out, right);
+   }
+
+   template <typename F>
+   static ptr decode(bytesReader& in, const F& load) {
+      std::pair<K, V> entry;
+      contentAddress left, right;
+      readRecord(in, entry);
+      readRecord(in, left, false);
+      readRecord(in, right, false);
+      return tree::make(load(left), entry, load(right));
+   }
+};
+
+template <typename T>
+struct snapshotCodec<pvector<T>> {
+   typedef typename pvector<T>::tree tree;
+   typedef typename tree::node node;
+   typedef typename tree::ptr ptr;
+
+   static ptr rootOf(const pvector<T>& coll) { return coll.rootNode(); }
+   static pvector<T> fromRoot(const ptr& root) { return pvector<T>(root); }
+
+   template <typename F>
+   static void encode(const ptr& n, bytesWriter& out, const F& store) {
+      std::vector<contentAddress> kids;
+      for (const auto& kid : n->kids) {
+         kids.push_back(store(kid));
+      }
+      uint32_t count = (uint32_t) (n->kids.empty() ? n->elems.size() : kids.size());
+      unsigned char isLeaf = n->kids.empty();
+      writeRecord(out, isLeaf);
+      writeRecord(out, count);
+      if (isLeaf) {
+         for (const auto& elem : n->elems) {
+            writeRecord(out, elem);
+         }
+      } else {
+         for (const auto& kid : kids) {
+            writeRecord(out, kid);
+         }
+      }
+   }
+
+   template <typename F>
+   static ptr decode(bytesReader& in, const F& load) {
+      unsigned char isLeaf = 0;
+      uint32_t count = 0;
+      readRecord(in, isLeaf);
+      readRecord(in, count, false);
+      if (isLeaf) {
+         std::vector<T> elems(count);
+         for (auto& elem : elems) {
+            readRecord(in, elem, false);
+         }
+         return tree::leaf(std::move(elems));
+      }
+      std::vector<ptr> kids;
+      for (uint32_t i = 0; i < count; ++i) {
+         contentAddress kid;
+         readRecord(in, kid, false);
+         kids.push_back(load(kid));
+      }
+      return tree::branch(std::move(kids));
+   }
+};
+
+} // namespace sanity_detail
+
+// __snapshotLog<C>__.
+// An append-only file of versions of a pmap or pvector. Nodes are stored
+// once, named by a hash of their contents, and save() appends only the
+// nodes the log does not already hold, so checkpointing a large
+// collection after a few updates costs O(k log n). load() maps the file
+// and rebuilds the nodes reachable from one version, reusing nodes
+// already loaded, so versions loaded from one log share structure in
+// memory as they do on disk. compact() rewrites the log without the
+// nodes no kept version reaches. Keys, vals and elements must be binary
+// records (see recordFile). A snapshotLog is not thread-safe.
+//
+// `snapshotLog<pmap<long, double>> log("state.log"); auto v = log.save(state); state = log.load(v);`
+template <typename C>
+class snapshotLog {
+public:
+   typedef sanity_detail::snapshotCodec<C> codec;
+   typedef typename codec::ptr nodePtr;
+
+   explicit snapshotLog(const std::string& path) : path(path) { open(); }
+
+   // Appends coll as a new version and returns its number once the
+   // version is on disk.
+   uint64_t save(const C& coll) {
+      uint64_t version = saveVersion(coll, nextVersion);
+      sync();
+      return version;
+   }
+
+   C load(uint64_t version) {
+      auto root = roots.find(version);
+      if (root == roots.end()) {
+         throw std::out_of_range("no such version in snapshot log");
+      }
+      remap();
+      return codec::fromRoot(loadNode(root->second));
+   }
+
+   std::vector<uint64_t> versions() const {
+      std::vector<uint64_t> result;
+      for (const auto& root : roots) {
+         result.push_back(root.first);
+      }
+      return result;
+   }
+
+   size_t fileSize() const { return fileEnd; }
+
+   // Rewrites the log with only the versions in keep. The rewritten log
+   // is synced and then renamed over the old one, and the rename is synced
+   // too, so a crash leaves one or the other intact.
+   void compact(const std::vector<uint64_t>& keep) {
+      std::string temporary = compactPath();
+      std::remove(temporary.c_str());
+      {
+         snapshotLog compacted(temporary);
+         for (uint64_t version : keep) {
+            compacted.saveVersion(load(version), version);
+         }
+         compacted.sync();
+      }
+      writer.reset();
+      mapped.reset();
+#if !defined(__unix__) && !defined(__APPLE__)
+      std::remove(path.c_str());
+#endif
+      if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+         throw std::runtime_error("cannot replace " + path);
+      }
+      sanity_detail::syncPath(sanity_detail::parentDirectory(path));
+      open();
+   }
+
+   void compact() { compact(versions()); }
+
+private:
+   typedef sanity_detail::contentAddress address;
+
+   static const char* magic() { return "sanitylg"; }
+   enum { headerSize = 8, nodeTag = 'N', rootTag = 'R' };
+
+   struct location {
+      size_t offset;
+      size_t length;
+   };
+
+   struct savedNode {
+      std::weak_ptr<const void> node;
+      address addr;
+   };
+
+   std::string compactPath() const { return path + ".compact"; }
+
+   void sync() {
+      writer->flush();
+      sanity_detail::syncPath(path);
+   }
+
+   // Indexes the log, cutting off any record left torn by a crash
+   // mid-append. A missing or empty file becomes a new log; any other file
+   // that is not a snapshot log is left untouched and rejected. A leftover
+   // compacted log is removed, or, if a crash took the log itself away
+   // mid-compact, put in its place.
+   void open() {
+      std::string temporary = compactPath();
+      if (std::ifstream(temporary) && !std::ifstream(path)) {
+         if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error("cannot restore " + path);
+         }
+      } else {
+         std::remove(temporary.c_str());
+      }
+      index.clear();
+      roots.clear();
+      saved.clear();
+      loaded.clear();
+      nextVersion = 1;
+      size_t valid = 0;
+      {
+         std::ifstream probe(path, std::ios::binary);
+         if (probe) {
+            mapped.reset(new sanity_detail::mappedFile(path));
+            valid = scan();
+            size_t size = mapped->size();
+            if (valid == 0 && (size > headerSize || !std::equal(mapped->data(), mapped->data() + size, magic()))) {
+               mapped.reset();
+               throw std::runtime_error(path + " is not a snapshot log");
+            }
+         }
+      }
+      if (valid == 0) {
+         sanity_detail::binaryWriter header(path, 0);
+         header.writeBytes(magic(), headerSize);
+         header.flush();
+         valid = headerSize;
+      } else if (valid < mapped->size()) {
+         size_t size = mapped->size();
+         mapped.reset();
+         sanity_detail::truncateFile(path, valid, size);
+      }
+      mapped.reset();
+      fileEnd = valid;
+      writer.reset(new sanity_detail::binaryWriter(path, sanity_detail::recordBufferSize, std::ios::in));
+      writer->seek(valid);
+   }
+
+   // Returns the length of the valid prefix of the mapped file, or 0 if
+   // it is not a snapshot log.
+   size_t scan() {
+      const char* data = mapped->data();
+      size_t size = mapped->size();
+      if (size < headerSize || !std::equal(data, data + headerSize, magic())) {
+         return 0;
+      }
+      size_t pos = headerSize;
+      while (pos < size) {
+         sanity_detail::bytesReader in(data + pos, size - pos);
+         try {
+            char tag = 0;
+            in.readBytes(&tag, 1, true);
+            address addr;
+            if (tag == nodeTag) {
+               uint64_t length = 0;
+               sanity_detail::readRecord(in, addr, false);
+               sanity_detail::readRecord(in, length, false);
+               size_t start = pos + 1 + sizeof(address) + sizeof(length);
+               if (length > size - start) {
+                  break;
+               }
+               location loc = { start, (size_t) length };
+               index[addr] = loc;
+               pos = start + (size_t) length;
+            } else if (tag == rootTag) {
+               uint64_t version = 0;
+               sanity_detail::readRecord(in, version, false);
+               sanity_detail::readRecord(in, addr, false);
+               roots[version] = addr;
+               nextVersion = std::max(nextVersion, version + 1);
+               pos += 1 + sizeof(version) + sizeof(address);
+            } else {
+               break;
+            }
+         } catch (const std::runtime_error&) {
+            break;
+         }
+      }
+      return pos;
+   }
+
+   uint64_t saveVersion(const C& coll, uint64_t version) {
+      address root = store(codec::rootOf(coll));
+      char tag = rootTag;
+      writer->writeBytes(&tag, 1);
+      sanity_detail::writeRecord(*writer, version);
+      sanity_detail::writeRecord(*writer, root);
+      fileEnd += 1 + sizeof(version) + sizeof(address);
+      roots[version] = root;
+      nextVersion = std::max(nextVersion, version + 1);
+      return version;
+   }
+
+   // Appends n and any of its descendants not yet in the log.
+   address store(const nodePtr& n) {
+      if (!n) {
+         return address();
+      }
+      auto known = saved.find(n.get());
+      if (known != saved.end() && known->second.node.lock().get() == n.get() && index.count(known->second.addr)) {
+         return known->second.addr;
+      }
+      sanity_detail::bytesWriter payload;
+      codec::encode(n, payload, [this](const nodePtr& kid) { return store(kid); });
+      // Two payloads may share a hash; only identical bytes share a node.
+      address addr;
+      auto existing = index.end();
+      for (uint64_t salt = 0;; ++salt) {
+         addr = sanity_detail::addressOf(payload.bytes, salt);
+         existing = index.find(addr);
+         if (existing == index.end() || holds(existing->second, payload.bytes)) {
+            break;
+         }
+      }
+      if (existing == index.end()) {
+         uint64_t length = payload.bytes.size();
+         char tag = nodeTag;
+         writer->writeBytes(&tag, 1);
+         sanity_detail::writeRecord(*writer, addr);
+         sanity_detail::writeRecord(*writer, length);
+         fileEnd += 1 + sizeof(address) + sizeof(length);
+         location loc = { fileEnd, payload.bytes.size() };
+         writer->writeBytes(payload.bytes.data(), payload.bytes.size());
+         fileEnd += payload.bytes.size();
+         index[addr] = loc;
+      }
+      remember(n, addr);
+      return addr;
+   }
+
+   // Maps everything written so far.
+   void remap() {
+      writer->flush();
+      if (!mapped || mapped->size() < fileEnd) {
+         mapped.reset(new sanity_detail::mappedFile(path));
+      }
+   }
+
+   bool holds(const location& loc, const std::string& bytes) {
+      if (loc.length != bytes.size()) {
+         return false;
+      }
+      if (!mapped || mapped->size() < loc.offset + loc.length) {
+         remap();
+      }
+      return std::equal(bytes.begin(), bytes.end(), mapped->data() + loc.offset);
+   }
+
+   nodePtr loadNode(const address& addr) {
+      if (addr.isNull()) {
+         return nodePtr();
+      }
+      auto cached = loaded.find(addr);
+      if (cached != loaded.end()) {
+         nodePtr n = std::static_pointer_cast<const typename codec::node>(cached->second.lock());
+         if (n) {
+            return n;
+         }
+      }
+      auto loc = index.find(addr);
+      if (loc == index.end()) {
+         throw std::runtime_error("snapshot log is missing a node");
+      }
+      sanity_detail::bytesReader in(mapped->data() + loc->second.offset, loc->second.length);
+      nodePtr n = codec::decode(in, [this](const address& kid) { return loadNode(kid); });
+      loaded[addr] = n;
+      remember(n, addr);
+      return n;
+   }
+
+   void remember(const nodePtr& n, const address& addr) {
+      if (saved.size() >= 2 * sweptSize) {
+         for (auto iter = saved.begin(); iter != saved.end();) {
+            iter = iter->second.node.expired() ? saved.erase(iter) : std::next(iter);
+         }
+         for (auto iter = loaded.begin(); iter != loaded.end();) {
+            iter = iter->second.expired() ? loaded.erase(iter) : std::next(iter);
+         }
+         sweptSize = std::max<size_t>(1024, saved.size());
+      }
+      savedNode entry = { n, addr };
+      saved[n.get()] = entry;
+   }
+
+   std::string path;
+   std::unique_ptr<sanity_detail::binaryWriter> writer;
+   std::unique_ptr<sanity_detail::mappedFile> mapped;
+   size_t fileEnd;
+   uint64_t nextVersion;
+   std::unordered_map<address, location, sanity_detail::contentAddressHash> index;
+   std::map<uint64_t, address> roots;
+   std::unordered_map<const void*, savedNode> saved;
+   std::unordered_map<address, std::weak_ptr<const void>, sanity_detail::contentAddressHash> loaded;
+   size_t sweptSize = 1024;
+};
+
+// ## Multi-process operations.
+//
+// These fork worker processes instead of starting threads, for functions
+// that are not safe to call concurrently in one process. Workers see coll
+// through the copy-on-write pages they inherit, so it is never copied or
+// serialized, and write their results straight into memory shared with
+// the parent. Results must be trivially copyable.
+//
+// A forked child gets only the thread that called fork, and any lock
+// another thread held at that moment stays held in the child forever.
+// Call these before anything here starts threads (the thread pool,
+// futures, channels, pipelines, agents), or when those threads are idle
+// and func touches none of them; otherwise a worker can deadlock.
+
+#ifdef __linux__
+
+namespace sanity_detail {
+
+// Anonymous memory that stays shared with processes forked after it is
+// mapped.
+class sharedBuffer {
+public:
+   explicit sharedBuffer(size_t size) : length(std::max<size_t>(size, 1)) {
+      base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+      if (base == MAP_FAILED) {
+         throw std::runtime_error("cannot map shared memory");
+      }
+   }
+   ~sharedBuffer() { munmap(base, length); }
+
+   void* data() const { return base; }
+
+private:
+   sharedBuffer(const sharedBuffer&);
+   sharedBuffer& operator=(const sharedBuffer&);
+
+   void* base;
+   size_t length;
+};
+
+// Runs work(i) in a forked child for each i in [0, nprocs) and waits for
+// all of them. Children leave with _exit, so they never run the parent's
+// exit handlers or flush its stdio buffers. Throws if any child fails.
+// Only safe while no other thread may hold a lock work needs.
+template <typename F>
+void forkWorkers(unsigned nprocs, const F& work) {
+   std::vector<pid_t> children;
+   bool failed = false;
+   for (unsigned i = 0; i < nprocs; ++i) {
+      pid_t pid = fork();
+      if (pid == 0) {
+         int status = 0;
+         try {
+            work(i);
+         } catch (...) {
+            status = 1;
+         }
+         _exit(status);
+      }
+      if (pid < 0) {
+         failed = true;
+         break;
+      }
+      children.push_back(pid);
+   }
+   for (pid_t child : children) {
+      int status = 0;
+      while (waitpid(child, &status, 0) < 0) {
+         if (errno != EINTR) {
+            status = -1;
+            break;
+         }
+      }
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+         failed = true;
+      }
+   }
+   if (failed) {
+      throw std::runtime_error("worker process failed");
+   }
+}
+
+inline unsigned defaultProcessCount() {
+   return std::max(1u, std::thread::hardware_concurrency());
+}
+
+} // namespace sanity_detail
+
+// __forkMap(coll, func, nprocs)__.
+// Like map(coll, func), with func applied in nprocs forked processes.
+// Workers claim small chunks of coll from a shared counter, so uneven
+// per-element costs stay balanced.
+//
+// `forkMap(records, parseWithLegacyLib, 8)`
+template <template <typename, typename> class C, typename A, typename B, typename F>
+auto forkMap(const C<A, B>& coll, const F& func, unsigned nprocs = sanity_detail::defaultProcessCount())
+      -> C<decltype(func(first(coll))), std::allocator<decltype(func(first(coll)))> > {
+   typedef decltype(func(first(coll))) elem;
+   static_assert(std::is_trivially_copyable<elem>::value, "forkMap results must be trivially copyable");
+   size_t n = coll.size();
+   if (n == 0) {
+      return C<elem, std::allocator<elem>>();
+   }
+   nprocs = (unsigned) std::min<size_t>(std::max(1u, nprocs), n);
+   size_t chunk = std::max<size_t>(1, n / (16 * nprocs));
+   sanity_detail::sharedBuffer counter(sizeof(std::atomic<size_t>));
+   sanity_detail::sharedBuffer output(n * sizeof(elem));
+   std::atomic<size_t>* next = new (counter.data()) std::atomic<size_t>(0);
+   // The mapping is page aligned, so it can hold elems directly.
+   elem* out = static_cast<elem*>(output.data());
+   sanity_detail::forkWorkers(nprocs, [&](unsigned) {
+      for (size_t begin = next->fetch_add(chunk); begin < n; begin = next->fetch_add(chunk)) {
+         size_t end = std::min(n, begin + chunk);
+         auto iter = coll.begin() + begin;
+         for (size_t i = begin; i < end; ++i, ++iter) {
+            new (out + i) elem(func(*iter));
+         }
+      }
+   });
+   return C<elem, std::allocator<elem>>(out, out + n);
+}
+
+// __forkReduce(init, coll, func, combine, nprocs)__.
+// Reduces contiguous slices of coll with func in nprocs forked processes,
+// each starting from init, then folds the partial results in order with
+// combine. init should be an identity for combine.
+//
+// `forkReduce(0L, lines, countWithLegacyLib, add<long>, 8)`
+template <typename A, typename C, typename F, typename G>
+A forkReduce(const A& init, const C& coll, const F& func, const G& combine,
+             unsigned nprocs = sanity_detail::defaultProcessCount()) {
+   static_assert(std::is_trivially_copyable<A>::value, "forkReduce results must be trivially copyable");
+   size_t n = coll.size();
+   if (n == 0) {
+      return init;
+   }
+   nprocs = (unsigned) std::min<size_t>(std::max(1u, nprocs), n);
+   size_t chunk = (n + nprocs - 1) / nprocs;
+   nprocs = (unsigned) ((n + chunk - 1) / chunk);
+   sanity_detail::sharedBuffer output(nprocs * sizeof(A));
+   char* out = static_cast<char*>(output.data());
+   sanity_detail::forkWorkers(nprocs, [&](unsigned worker) {
+      size_t begin = worker * chunk;
+      size_t end = std::min(n, begin + chunk);
+      A acc = init;
+      for (auto iter = coll.begin() + begin; iter != coll.begin() + end; ++iter) {
+         acc = func(acc, *iter);
+      }
+      std::copy(reinterpret_cast<const char*>(&acc), reinterpret_cast<const char*>(&acc) + sizeof(A), out + worker * sizeof(A));
+   });
+   A result = init;
+   for (unsigned worker = 0; worker < nprocs; ++worker) {
+      A partial = init;
+      std::copy(out + worker * sizeof(A), out + (worker + 1) * sizeof(A), reinterpret_cast<char*>(&partial));
+      result = combine(result, partial);
+   }
+   return result;
+}
+
+#endif
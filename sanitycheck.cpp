@@ -5,6 +5,8 @@
 
 #include "sanity.h"
 
+#include <cassert>
+
 double times2(double x) {
    return 2 * x;
 }
@@ -38,6 +40,257 @@ int _tmain(int argc, _TCHAR* argv[]) {
    auto r3 = maximum(map(range(30), times2));
    auto c = contains(range(100), 50);
    auto q = indexOf(shuffle(range(10000)), (long) 999);
+   auto m1 = zipmap(range(10), map(range(10), times2));
+   auto m2 = zipmapParallel(shuffle(range(100000)), range(100000));
+   std::map<long, long> renames;
+   renames[1] = 100;
+   auto m3 = renameKeys(m2, renames);
+   auto m4 = selectKeys(m2, range(10));
+   assert(m1.size() == 10 && m1[3] == 6.0 && m2.size() == 100000);
+   assert(m3.size() == 99999 && m3[100] == m2[1] && m4.size() == 10 && m4[7] == m2[7]);
+   pmap<long, long> pm = assoc(assoc(pmap<long, long>(), 1L, 2L), 3L, 4L);
+   auto pm1 = renameKeys(pm, renames);
+   auto pm2 = selectKeys(pm1, range(5));
+   assert(pm1.size() == 2 && *pm1.valAt(100) == 2 && pm2.size() == 1 && *pm2.valAt(3) == 4);
+   atom<pmap<long, long>> shared(pm);
+   shared.swap([](const pmap<long, long>& m, long k, long v) { return assoc(m, k, v); }, 5L, 6L);
+   auto pm3 = shared.deref();
+   assert(pm3->size() == 3 && *pm3->valAt(5) == 6);
+   std::atomic<int> watched(0);
+   shared.addWatch("a", [](const atom<pmap<long, long>>::snapshot&, const atom<pmap<long, long>>::snapshot&) {
+      throw std::runtime_error("failing watch");
+   });
+   shared.addWatch("b", [&watched](const atom<pmap<long, long>>::snapshot&, const atom<pmap<long, long>>::snapshot&) {
+      ++watched;
+   });
+   shared.reset(pmap<long, long>());
+   while (watched < 1) {
+      std::this_thread::yield();
+   }
+   shared.reset(pm);
+   while (watched < 2) {
+      std::this_thread::yield();
+   }
+   shared.removeWatch("b");
+   ref<double> from(100), to(0);
+   dosync([&](transaction& tx) {
+      tx.alter(from, plus, -10.0);
+      tx.alter(to, plus, 10.0);
+   });
+   dosync([&](transaction& tx) {
+      const double& before = tx.get(from);
+      tx.set(from, 0.0);
+      tx.set(from, before);
+   });
+   assert(*from.deref() == 90.0 && *to.deref() == 10.0);
+   rcu<std::map<long, double>> lookups(zipmap(range(10), map(range(10), times2)));
+   lookups.update([](const std::map<long, double>& m) { return assoc(m, 10L, 20.0); });
+   auto l1 = lookups.read()->size();
+   assert(l1 == 11);
+   auto numbers = toChan(x, 4);
+   auto signs = split(map(numbers, times2), positive, 4);
+   auto c1 = takeAll(merge(std::vector<chan<double>>{signs.first, filter(signs.second, [](double q) { return q < -5; })}));
+   assert(sort(c1) == std::vector<double>({-20, 2, 4, 6, 8}));
+   auto parsed = pipeline<std::string>::from(split("1,2,3,-4", ","), 2)
+      .map([](const std::string& s) { return std::stod(s); }, 4, false)
+      .filter(positive);
+   auto p1 = parsed.reduce(0.0, plus);
+   auto p2 = parsed.stats();
+   assert(p1 == 6.0);
+   assert(p2.size() == 3 && p2.back().itemsIn == 4 && p2.back().itemsOut == 3);
+   assert(pipeline<long>::from(range(5000L), 7, 2).map(inc<long>, 4).filter(isEven<long>, 3).collect() == filter(map(range(5000L), inc<long>), isEven<long>));
+   auto f1 = futureCall([]() { return range(1000); }).then([](const std::vector<long>& r) { return reduce(r, add<long, long>); });
+   auto f2 = whenAll(std::vector<future<long>>{f1, pmapAsync(range(10), inc<long>).then([](const std::vector<long>& r) { return maximum(r); })});
+   auto f3 = f2.get();
+   assert(f3.size() == 2 && f3[0] == 499500 && f3[1] == 10);
+   long sideEffect = 0;
+   futureCall([&sideEffect]() { sideEffect = 1; }).then([&sideEffect]() { ++sideEffect; }).get();
+   assert(sideEffect == 2);
+   auto d1 = delay([]() { return shuffle(range(100)); });
+   auto d2 = first(d1.get());
+   assert(d2 >= 0 && d2 < 100 && sort(d1.get()) == range(100));
+   auto deadline = cancellationToken::withTimeout(std::chrono::seconds(10));
+   auto t1 = sort(shuffle(range(100000)), deadline);
+   auto t2 = filter(map(t1, times2, deadline), positive, deadline);
+   assert(t1 == range(100000) && t2.size() == 99999);
+   assert(map(range(10000L), inc<long>, deadline, 4) == map(range(10000L), inc<long>));
+   assert(filter(range(10000L), isEven<long>, deadline, 4) == filter(range(10000L), isEven<long>));
+   auto fastTimes2 = memoize(times2, 1000);
+   auto t3 = map(map(range(100000), [](long q) { return (double) (q % 100); }), fastTimes2, deadline);
+   auto t4 = fastTimes2.hits();
+   assert(t3.size() == 100000 && t3[150] == 100.0);
+   assert(t4 + fastTimes2.misses() == 100000 && fastTimes2.misses() >= 100 && fastTimes2.size() == 100);
+   auto k1 = map(x, comp(times2, partial(plus, 1.0)));
+   auto k2 = filter(x, complement(positive));
+   auto k3 = any(x, comp(positive, times2));
+   auto k4 = juxt(times2, positive)(3.0);
+   auto k5 = fnil(times2, 0.0)(pm.valAt(99));
+   auto k6 = map(x, constantly(1));
+   assert(k1 == std::vector<double>({4, 6, 8, -18, 0, 10}) && k2 == std::vector<double>({-10, -1}) && k3);
+   assert(std::get<0>(k4) == 6.0 && std::get<1>(k4) && k5 == 0.0 && k6 == std::vector<int>(6, 1));
+   assert(first(cons(std::deque<double>(x.begin(), x.end()), 0.0)) == 0.0);
+   std::deque<double> xs(x.begin(), x.end());
+   assert(concat(xs, x).size() == 12 && interleave(xs, x)[1] == 1.0);
+   pdeque<double> dq(x.begin(), x.end());
+   auto dq1 = conj(cons(dq, 0.0), 5.0);
+   auto dq2 = concat(rest(dq1), butlast(dq1));
+   auto dq3 = first(drop(dq2, 3)) + last(take(dq2, 4));
+   assert(first(dq1) == 0.0 && last(dq1) == 5.0 && dq2.size() == 14 && dq3 == -20.0);
+   pvector<double> pv(x.begin(), x.end());
+   auto pv1 = insertAt(concat(pv, subvec(pv, 1, 3)), 2, 10.0);
+   std::vector<double> expectedPv1 = { 1, 2, 10, 3, -10, -1, 4, 2, 3 };
+   assert(pv1 == pvector<double>(expectedPv1.begin(), expectedPv1.end()));
+   std::mt19937 positions(89);
+   pvector<long> shuffled;
+   std::vector<long> shuffledExpected;
+   for (long i = 0; i < 20000; ++i) {
+      size_t at = positions() % (shuffledExpected.size() + 1);
+      shuffled = shuffled.insert(at, i);
+      shuffledExpected.insert(shuffledExpected.begin() + at, i);
+   }
+   for (int i = 0; i < 2000; ++i) {
+      size_t at = positions() % (shuffled.size() + 1);
+      auto parts = shuffled.splitAt(at);
+      shuffled = parts.second.concat(parts.first);
+      std::rotate(shuffledExpected.begin(), shuffledExpected.begin() + at, shuffledExpected.end());
+   }
+   // A dense tree of 20000 elements has height 2; joins may add at most a level.
+   assert(pvector<long>::tree::heightOf(shuffled.rootNode()) <= 3);
+   assert(shuffled == pvector<long>(shuffledExpected.begin(), shuffledExpected.end()));
+   phashset<double> hs(x.begin(), x.end());
+   psortedset<double> ss(x.begin(), x.end());
+   auto hs1 = difference(setUnion(hs, conj(hs, 10.0)), intersection(hs, disj(hs, 1.0)));
+   auto ss1 = difference(setUnion(ss, conj(ss, 10.0)), intersection(ss, disj(ss, 1.0)));
+   assert(hs1.size() == 2 && contains(hs1, 1.0) && contains(hs1, 10.0));
+   assert(ss1.size() == 2 && contains(ss1, 1.0) && contains(ss1, 10.0));
+   pheap<double> ph(x.begin(), x.end());
+   auto ph1 = first(rest(meld(conj(ph, 0.5), ph)));
+   assert(ph1 == -10.0);
+   std::unordered_map<pvector<double>, double> byVector;
+   byVector[pv1] = pv1.hash() == concat(take(pv1, 2), drop(pv1, 2)).hash() ? 1.0 : 0.0;
+   auto canonical = hashCons(pv1) == hashCons(insertAt(concat(pv, subvec(pv, 1, 3)), 2, 10.0));
+   assert(byVector[pv1] == 1.0 && canonical);
+   std::map<keyword, double> fields = zipmap(split<keyword>("id,price", ","), take(x, 2));
+   auto price = get(assoc(fields, "tax", 0.5), "price", 0.0);
+   assert(keys(std::map<keyword, int>{{"b", 1}, {"a", 2}}) == std::vector<keyword>({"a", "b"}));
+   auto delta = diff(pm1, assoc(pm1, 42L, 1L));
+   auto vectorDelta = diff(pv, pv1);
+   assert(price == 2.0 && delta.added.size() == 1 && delta.added[0].second == 1 && delta.removed.empty() && delta.changed.empty());
+   assert(vectorDelta.added.size() == 3 && vectorDelta.changed.size() == 4 && vectorDelta.removed.empty());
+   auto bigVals = filterView(pm1, [](long v) { return v > 3; });
+   auto incremental = bigVals.update(assoc(pm1, 7L, 8L)) == filterView(assoc(pm1, 7L, 8L), [](long v) { return v > 3; }).value();
+   auto byParity = groupByView(pm1, isEven<long>).update(dissoc(pm1, 1L));
+   assert(incremental && byParity.size() == 1 && byParity.valAt(true)->size() == 2);
+   std::mt19937 changes(96);
+   pmap<long, long> source;
+   auto evens = filterView(source, isEven<long>);
+   auto halves = mapFilterView(source, [](long v) { return v / 2.0; }, positive);
+   auto byRemainder = groupByView(source, [](long v) { return v % 3; });
+   for (int step = 0; step < 500; ++step) {
+      for (unsigned n = changes() % 5; n > 0; --n) {
+         long key = changes() % 100;
+         source = changes() % 4 == 0 ? dissoc(source, key) : assoc(source, key, (long) (changes() % 50));
+      }
+      pmap<long, long> allEvens;
+      pmap<long, double> allHalves;
+      pmap<long, pmap<long, long>> allByRemainder;
+      for (const auto& kv : source) {
+         if (isEven(kv.second)) {
+            allEvens = assoc(allEvens, kv.first, kv.second);
+         }
+         if (positive(kv.second / 2.0)) {
+            allHalves = assoc(allHalves, kv.first, kv.second / 2.0);
+         }
+         long remainder = kv.second % 3;
+         allByRemainder = assoc(allByRemainder, remainder, assoc(get(allByRemainder, remainder, pmap<long, long>()), kv.first, kv.second));
+      }
+      assert(evens.update(source) == allEvens);
+      assert(halves.update(source) == allHalves);
+      assert(byRemainder.update(source) == allByRemainder);
+   }
+   auto sortedCount = externalSort(x, "sorted.bin", 1 << 20, std::greater<double>());
+   std::vector<double> sortedBack(recordFile<double>("sorted.bin").begin(), recordFile<double>("sorted.bin").end());
+   std::remove("sorted.bin");
+   assert(sortedCount == 6 && sortedBack == std::vector<double>({4, 3, 2, 1, -1, -10}));
+   std::vector<std::pair<long, long>> records;
+   for (long i = 0; i < 300000; ++i) {
+      records.push_back(std::make_pair(i * 7919 % 1000, i));
+   }
+   auto byKey = [](const std::pair<long, long>& p, const std::pair<long, long>& q) { return p.first < q.first; };
+   assert(externalSort(records, "spilled.bin", 1 << 20, byKey) == records.size());
+   std::vector<std::pair<long, long>> spilledBack(recordFile<std::pair<long, long>>("spilled.bin").begin(),
+                                                  recordFile<std::pair<long, long>>("spilled.bin").end());
+   std::remove("spilled.bin");
+   std::stable_sort(records.begin(), records.end(), byKey);
+   assert(spilledBack == records);
+   for (int run = 0; run < 30; ++run) {
+      assert(!std::ifstream("spilled.bin.run" + std::to_string(run)));
+   }
+   auto groups = groupBy(x, positive);
+   std::map<double, long> counts;
+   frequencies(x, 1 << 20, [&counts](double val, long n) { counts[val] = n; });
+   assert(groups[true].size() == 4 && groups[false] == std::vector<double>({-10, -1}));
+   assert(counts.size() == x.size() && counts[3.0] == 1);
+   std::map<std::pair<bool, double>, long> pairCounts;
+   frequencies(map(x, [](double q) { return std::make_pair(q > 0, q); }), 1 << 20,
+               [&pairCounts](const std::pair<bool, double>& key, long n) { pairCounts[key] = n; });
+   assert(pairCounts.size() == x.size() && pairCounts[std::make_pair(false, -10.0)] == 1);
+#if defined(__unix__) || defined(__APPLE__)
+   std::string spillDirectory = "spill-test";
+   mkdir(spillDirectory.c_str(), 0700);
+#else
+   std::string spillDirectory = ".";
+#endif
+   std::map<long, long> manyCounts;
+   frequencies(map(range(300000L), [](long v) { return v % 100000; }), 1 << 16,
+               [&manyCounts](long val, long n) { manyCounts[val] = n; }, spillDirectory);
+   assert(manyCounts.size() == 100000 && every(vals(manyCounts), [](long n) { return n == 3; }));
+   // Key 0 stays too big to fit at every level, so it ends up grouped in memory.
+   std::map<long, std::vector<long>> spilledGroups;
+   groupBy(range(300000L), [](long v) { return v < 100000 ? 0 : v % 50000; }, 1 << 16,
+           [&spilledGroups](long key, const std::vector<long>& items) { spilledGroups[key] = items; }, spillDirectory);
+   assert(spilledGroups.size() == 50000 && spilledGroups[0].size() == 100004 && spilledGroups[1] == std::vector<long>({100001, 150001, 200001, 250001}));
+   assert(every(vals(spilledGroups), [](const std::vector<long>& items) { return std::is_sorted(items.begin(), items.end()); }));
+#if defined(__unix__) || defined(__APPLE__)
+   assert(rmdir(spillDirectory.c_str()) == 0);
+#endif
+   {
+      snapshotLog<pvector<double>> snapshots("snapshots.log");
+      auto version = snapshots.save(pv1);
+      snapshots.save(assoc(pv1, 0, 2.0));
+      assert(snapshotLog<pvector<double>>("snapshots.log").load(version) == pv1);
+      auto repeated = concat(concat(pv1, pv1), concat(pv1, pv1));
+      assert(snapshots.load(snapshots.save(repeated)) == repeated);
+      snapshots.compact({ version });
+      auto reloaded = snapshots.load(version) == pv1;
+      assert(reloaded);
+   }
+   {
+      std::ofstream("snapshots.log", std::ios::binary | std::ios::app) << 'N' << std::string(20, '\x7f');
+      std::ofstream("snapshots.log.compact") << "stale";
+      snapshotLog<pvector<double>> recovered("snapshots.log");
+      assert(recovered.versions().size() == 1 && recovered.load(recovered.versions()[0]) == pv1);
+      auto next = recovered.save(conj(pv1, 1.0));
+      snapshotLog<pvector<double>> reopened("snapshots.log");
+      assert(reopened.versions().size() == 2 && reopened.load(next) == conj(pv1, 1.0));
+      assert(reopened.fileSize() == recovered.fileSize() && !std::ifstream("snapshots.log.compact"));
+   }
+   std::remove("snapshots.log");
+   spit("notalog.txt", "data");
+   assert(slurp("notalog.txt") == "data");
+   bool rejected = false;
+   try {
+      snapshotLog<pvector<double>> notALog("notalog.txt");
+   } catch (const std::runtime_error&) {
+      rejected = true;
+   }
+   assert(rejected);
+   std::remove("notalog.txt");
+#ifdef __linux__
+   auto squaredInWorkers = forkMap(x, [](double v) { return v * v; }, 2);
+   auto sumInWorkers = forkReduce(0.0, x, plus, plus, 2);
+   assert(squaredInWorkers == map(x, [](double v) { return v * v; }) && sumInWorkers == -1.0);
+#endif
    return 0;
 }
 